@@ -0,0 +1,394 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the driver hot paths.
+ *
+ * Each test drives one UXA entry point through the protocol for a fixed
+ * time and reports operations per second.  When given the pid of the
+ * server (-p) the VIRGL_STATS root window property is refreshed with
+ * SIGUSR2 around every test, and the transfer and ioctl deltas are
+ * reported per operation as well.  Run it against a server using
+ * Option "SimulateDevice" to get numbers without a GPU.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
+
+#define SIZE		256
+#define BATCH		64
+
+struct bench_stats {
+    unsigned long long ioctls;
+    unsigned long long upload_bytes;
+    unsigned long long readback_bytes;
+    unsigned long long fallbacks;
+};
+
+struct bench_ctx {
+    Display *dpy;
+    Window root;
+    Window win;
+    Pixmap src;
+    Pixmap dst;
+    Pixmap copy_src;
+    GC gc;
+    XImage *image;
+    Picture src_pict;
+    Picture dst_pict;
+    GlyphSet glyphs;
+    Atom stats_atom;
+    pid_t server;
+};
+
+struct bench_test {
+    const char *name;
+    void (*run)(struct bench_ctx *ctx, int i);
+};
+
+static double
+now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+parse_stats (const char *text, struct bench_stats *stats)
+{
+    char name[64];
+    unsigned long long a, b;
+    const char *line;
+    int section = -1;
+
+    memset (stats, 0, sizeof (*stats));
+
+    for (line = text; line && *line; line = strchr (line, '\n'))
+    {
+	if (*line == '\n')
+	    line++;
+	if (!strncmp (line, "operation ", 10))
+	    section = 0;
+	else if (!strncmp (line, "ioctl ", 6))
+	    section = 1;
+	else if (!strncmp (line, "transfer ", 9))
+	    section = 2;
+	else if (sscanf (line, "%63s %llu %llu", name, &a, &b) == 3)
+	{
+	    if (section == 0)
+		stats->fallbacks += b;
+	    else if (section == 1)
+		stats->ioctls += a;
+	    else if (section == 2 && !strcmp (name, "upload"))
+		stats->upload_bytes = b;
+	    else if (section == 2 && !strcmp (name, "readback"))
+		stats->readback_bytes = b;
+	}
+    }
+}
+
+/* ask the server to refresh VIRGL_STATS and wait until it did */
+static int
+snapshot (struct bench_ctx *ctx, struct bench_stats *stats)
+{
+    Atom type;
+    int format;
+    unsigned long n, after;
+    unsigned char *data = NULL;
+    XEvent ev;
+
+    if (!ctx->server)
+	return 0;
+
+    XSync (ctx->dpy, False);
+    if (kill (ctx->server, SIGUSR2))
+	return 0;
+
+    do {
+	XWindowEvent (ctx->dpy, ctx->root, PropertyChangeMask, &ev);
+    } while (ev.xproperty.atom != ctx->stats_atom);
+
+    if (XGetWindowProperty (ctx->dpy, ctx->root, ctx->stats_atom, 0, 1 << 16,
+			    False, XA_STRING, &type, &format, &n, &after,
+			    &data) != Success || !data)
+	return 0;
+
+    parse_stats ((const char *)data, stats);
+    XFree (data);
+    return 1;
+}
+
+static void
+run_copy (struct bench_ctx *ctx, int i)
+{
+    XCopyArea (ctx->dpy, ctx->copy_src, ctx->dst, ctx->gc,
+	       0, 0, SIZE, SIZE, 0, 0);
+}
+
+static void
+run_copy_overlap (struct bench_ctx *ctx, int i)
+{
+    XCopyArea (ctx->dpy, ctx->dst, ctx->dst, ctx->gc,
+	       0, 0, SIZE - 8, SIZE - 8, (i & 1) ? 0 : 8, 8);
+}
+
+static void
+run_put_image (struct bench_ctx *ctx, int i)
+{
+    XPutImage (ctx->dpy, ctx->dst, ctx->gc, ctx->image,
+	       0, 0, 0, 0, SIZE, SIZE);
+}
+
+static void
+run_get_image (struct bench_ctx *ctx, int i)
+{
+    XImage *image;
+
+    image = XGetImage (ctx->dpy, ctx->dst, 0, 0, SIZE, SIZE,
+		       AllPlanes, ZPixmap);
+    if (image)
+	XDestroyImage (image);
+}
+
+static void
+run_fill_rect (struct bench_ctx *ctx, int i)
+{
+    XRectangle rects[16];
+    int j;
+
+    for (j = 0; j < 16; j++)
+    {
+	rects[j].x = (j % 4) * (SIZE / 4);
+	rects[j].y = (j / 4) * (SIZE / 4);
+	rects[j].width = SIZE / 4 - 2;
+	rects[j].height = SIZE / 4 - 2;
+    }
+    XSetForeground (ctx->dpy, ctx->gc, i * 0x010203);
+    XFillRectangles (ctx->dpy, ctx->dst, ctx->gc, rects, 16);
+}
+
+static void
+run_composite (struct bench_ctx *ctx, int i)
+{
+    XRenderComposite (ctx->dpy, PictOpOver, ctx->src_pict, None,
+		      ctx->dst_pict, 0, 0, 0, 0, 0, 0, SIZE, SIZE);
+}
+
+static void
+run_glyphs (struct bench_ctx *ctx, int i)
+{
+    static const char text[] = "The quick brown fox jumps over the lazy dog";
+    int y;
+
+    for (y = 16; y < SIZE; y += 16)
+	XRenderCompositeString8 (ctx->dpy, PictOpOver, ctx->src_pict,
+				 ctx->dst_pict, NULL, ctx->glyphs, 0, 0,
+				 0, y, text, sizeof (text) - 1);
+}
+
+/* arcs are not accelerated, so this measures prepare/finish_access */
+static void
+run_fallback (struct bench_ctx *ctx, int i)
+{
+    XDrawArc (ctx->dpy, ctx->dst, ctx->gc, i % 32, i % 32,
+	      SIZE / 2, SIZE / 2, 0, 360 * 64);
+}
+
+static const struct bench_test tests[] = {
+    { "copy",		run_copy },
+    { "copy-overlap",	run_copy_overlap },
+    { "put-image",	run_put_image },
+    { "get-image",	run_get_image },
+    { "fill-rect",	run_fill_rect },
+    { "composite",	run_composite },
+    { "glyphs",		run_glyphs },
+    { "fallback",	run_fallback },
+};
+
+static void
+setup (struct bench_ctx *ctx)
+{
+    Display *dpy = ctx->dpy;
+    XRenderPictFormat *argb, *a8, *fmt;
+    XWindowAttributes attr;
+    XImage *src_image;
+    GC gc;
+    char *data;
+    int i;
+
+    ctx->root = DefaultRootWindow (dpy);
+    XSelectInput (dpy, ctx->root, PropertyChangeMask);
+    ctx->stats_atom = XInternAtom (dpy, "VIRGL_STATS", False);
+
+    ctx->win = XCreateSimpleWindow (dpy, ctx->root, 0, 0, SIZE, SIZE, 0, 0, 0);
+    XMapWindow (dpy, ctx->win);
+    XGetWindowAttributes (dpy, ctx->win, &attr);
+
+    ctx->src = XCreatePixmap (dpy, ctx->win, SIZE, SIZE, 32);
+    ctx->dst = XCreatePixmap (dpy, ctx->win, SIZE, SIZE, attr.depth);
+    ctx->gc = XCreateGC (dpy, ctx->dst, 0, NULL);
+
+    data = malloc (SIZE * SIZE * 4);
+    for (i = 0; i < SIZE * SIZE; i++)
+	((unsigned int *)data)[i] = 0x80000000 | (i * 2654435761u >> 8);
+    ctx->image = XCreateImage (dpy, attr.visual, attr.depth, ZPixmap, 0,
+			       data, SIZE, SIZE, 32, 0);
+
+    ctx->copy_src = XCreatePixmap (dpy, ctx->win, SIZE, SIZE, attr.depth);
+    XPutImage (dpy, ctx->copy_src, ctx->gc, ctx->image, 0, 0, 0, 0, SIZE, SIZE);
+
+    argb = XRenderFindStandardFormat (dpy, PictStandardARGB32);
+    fmt = XRenderFindVisualFormat (dpy, attr.visual);
+    ctx->src_pict = XRenderCreatePicture (dpy, ctx->src, argb, 0, NULL);
+    ctx->dst_pict = XRenderCreatePicture (dpy, ctx->dst, fmt, 0, NULL);
+
+    src_image = XCreateImage (dpy, attr.visual, 32, ZPixmap, 0,
+			      data, SIZE, SIZE, 32, 0);
+    gc = XCreateGC (dpy, ctx->src, 0, NULL);
+    XPutImage (dpy, ctx->src, gc, src_image, 0, 0, 0, 0, SIZE, SIZE);
+    XFreeGC (dpy, gc);
+
+    a8 = XRenderFindStandardFormat (dpy, PictStandardA8);
+    ctx->glyphs = XRenderCreateGlyphSet (dpy, a8);
+    for (i = 32; i < 128; i++)
+    {
+	static char bits[8 * 12];
+	XGlyphInfo info = { 8, 12, 0, 11, 9, 0 };
+	Glyph id = i;
+	int j;
+
+	for (j = 0; j < (int)sizeof (bits); j++)
+	    bits[j] = ((j + i) & 3) ? 0xff : 0;
+	XRenderAddGlyphs (dpy, ctx->glyphs, &id, &info, 1, bits, sizeof (bits));
+    }
+
+    XSync (dpy, False);
+}
+
+static void
+usage (const char *argv0)
+{
+    fprintf (stderr,
+	     "usage: %s [-d display] [-p server-pid] [-t seconds] [test...]\n",
+	     argv0);
+    exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct bench_ctx ctx;
+    const char *display = NULL;
+    double seconds = 2.0;
+    unsigned int t;
+    int opt;
+
+    memset (&ctx, 0, sizeof (ctx));
+
+    while ((opt = getopt (argc, argv, "d:p:t:h")) != -1)
+    {
+	switch (opt)
+	{
+	case 'd':
+	    display = optarg;
+	    break;
+	case 'p':
+	    ctx.server = atoi (optarg);
+	    break;
+	case 't':
+	    seconds = atof (optarg);
+	    break;
+	default:
+	    usage (argv[0]);
+	}
+    }
+
+    ctx.dpy = XOpenDisplay (display);
+    if (!ctx.dpy)
+    {
+	fprintf (stderr, "cannot open display\n");
+	return 1;
+    }
+
+    setup (&ctx);
+
+    printf ("%-14s %12s %12s %12s %10s %10s\n", "test", "ops/s",
+	    "upload B/op", "readback B/op", "ioctls/op", "fallbacks");
+
+    for (t = 0; t < sizeof (tests) / sizeof (tests[0]); t++)
+    {
+	const struct bench_test *test = &tests[t];
+	struct bench_stats before, after;
+	unsigned long ops = 0;
+	double start, elapsed;
+	int have_stats;
+	int i;
+
+	if (optind < argc)
+	{
+	    for (i = optind; i < argc; i++)
+		if (!strcmp (argv[i], test->name))
+		    break;
+	    if (i == argc)
+		continue;
+	}
+
+	/* warm up caches and migrations */
+	for (i = 0; i < BATCH; i++)
+	    test->run (&ctx, i);
+
+	have_stats = snapshot (&ctx, &before);
+
+	start = now ();
+	do {
+	    for (i = 0; i < BATCH; i++)
+		test->run (&ctx, ops + i);
+	    XSync (ctx.dpy, False);
+	    ops += BATCH;
+	    elapsed = now () - start;
+	} while (elapsed < seconds);
+
+	have_stats = have_stats && snapshot (&ctx, &after);
+
+	printf ("%-14s %12.0f", test->name, ops / elapsed);
+	if (have_stats)
+	    printf (" %12.0f %12.0f %10.2f %10.2f",
+		    (double)(after.upload_bytes - before.upload_bytes) / ops,
+		    (double)(after.readback_bytes - before.readback_bytes) / ops,
+		    (double)(after.ioctls - before.ioctls) / ops,
+		    (double)(after.fallbacks - before.fallbacks) / ops);
+	printf ("\n");
+    }
+
+    XCloseDisplay (ctx.dpy);
+    return 0;
+}
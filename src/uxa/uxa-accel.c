@@ -78,15 +78,27 @@ uxa_fill_spans(DrawablePtr pDrawable, GCPtr pGC, int n,
 	if (!dst_pixmap)
 		goto fallback;
 
-	if (pGC->alu != GXcopy || pGC->planemask != FB_ALLONES)
+	/* Spans are plain fills; only build pictures for the composite path
+	 * when the driver cannot do them with solid().
+	 */
+	if ((!uxa_screen->info->check_solid ||
+	     uxa_screen->info->check_solid(pDrawable, pGC->alu, pGC->planemask)) &&
+	    uxa_screen->info->prepare_solid(dst_pixmap,
+					    pGC->alu,
+					    pGC->planemask,
+					    pGC->fgPixel))
 		goto solid;
 
+	/* composite can only do what solid() just refused for GXcopy */
+	if (pGC->alu != GXcopy || pGC->planemask != FB_ALLONES)
+		goto fallback;
+
 	format = PictureMatchFormat(screen,
 				    dst_pixmap->drawable.depth,
 				    format_for_depth(dst_pixmap->drawable.depth));
 	dst = CreatePicture(0, &dst_pixmap->drawable, format, 0, 0, serverClient, &error);
 	if (!dst)
-		goto solid;
+		goto fallback;
 
 	ValidatePicture(dst);
 
@@ -99,13 +111,13 @@ uxa_fill_spans(DrawablePtr pDrawable, GCPtr pGC, int n,
 	src = CreateSolidPicture(0, &color, &error);
 	if (!src) {
 		FreePicture(dst, 0);
-		goto solid;
+		goto fallback;
 	}
 
 	if (!uxa_screen->info->check_composite(PictOpSrc, src, NULL, dst, 0, 0)) {
 		FreePicture(src, 0);
 		FreePicture(dst, 0);
-		goto solid;
+		goto fallback;
 	}
 
 	if (!uxa_screen->info->check_composite_texture ||
@@ -122,14 +134,14 @@ uxa_fill_spans(DrawablePtr pDrawable, GCPtr pGC, int n,
 		if (!src_pixmap) {
 			FreePicture(src, 0);
 			FreePicture(dst, 0);
-			goto solid;
+			goto fallback;
 		}
 	}
 
 	if (!uxa_screen->info->prepare_composite(PictOpSrc, src, NULL, dst, src_pixmap, NULL, dst_pixmap)) {
 		FreePicture(src, 0);
 		FreePicture(dst, 0);
-		goto solid;
+		goto fallback;
 	}
 
 	pextent = REGION_EXTENTS(pGC->screen, pClip);
@@ -194,19 +206,10 @@ uxa_fill_spans(DrawablePtr pDrawable, GCPtr pGC, int n,
 	uxa_screen->info->done_composite(dst_pixmap);
 	FreePicture(src, 0);
 	FreePicture(dst, 0);
+	UXA_STATS_ACCEL(screen, UXA_OP_FILL_SPANS);
 	return;
 
 solid:
-	if (uxa_screen->info->check_solid &&
-	    !uxa_screen->info->check_solid(pDrawable, pGC->alu, pGC->planemask))
-		goto fallback;
-
-	if (!(*uxa_screen->info->prepare_solid) (dst_pixmap,
-						 pGC->alu,
-						 pGC->planemask,
-						 pGC->fgPixel))
-		goto fallback;
-
 	pextent = REGION_EXTENTS(pGC->screen, pClip);
 	extentX1 = pextent->x1;
 	extentY1 = pextent->y1;
@@ -262,6 +265,7 @@ solid:
 		}
 	}
 	(*uxa_screen->info->done_solid) (dst_pixmap);
+	UXA_STATS_ACCEL(screen, UXA_OP_FILL_SPANS);
 
 	return;
 
@@ -366,7 +370,8 @@ uxa_put_image(DrawablePtr pDrawable, GCPtr pGC, int depth, int x, int y,
 			      PixmapBytePad(w, pDrawable->depth))) {
 		uxa_check_put_image(pDrawable, pGC, depth, x, y, w, h, leftPad,
 				    format, bits);
-	}
+	} else
+		UXA_STATS_ACCEL(pDrawable->pScreen, UXA_OP_PUT_IMAGE);
 }
 
 static Bool inline
@@ -530,8 +535,10 @@ uxa_copy_n_to_n(DrawablePtr pSrcDrawable,
 	if ((uxa_screen->info->flags & UXA_TWO_BITBLT_DIRECTIONS) &&
 	    reverse != upsidedown) {
 		if (uxa_copy_n_to_n_two_dir
-		    (pSrcDrawable, pDstDrawable, pGC, pbox, nbox, dx, dy))
+		    (pSrcDrawable, pDstDrawable, pGC, pbox, nbox, dx, dy)) {
+			UXA_STATS_ACCEL(screen, UXA_OP_COPY);
 			return;
+		}
 		goto fallback;
 	}
 
@@ -594,6 +601,7 @@ uxa_copy_n_to_n(DrawablePtr pSrcDrawable,
 	    }
 	}
 
+	UXA_STATS_ACCEL(screen, UXA_OP_COPY);
 	return;
 
 fallback:
@@ -609,6 +617,7 @@ fallback:
 	UXA_FALLBACK(("from %p to %p (%c,%c)\n", pSrcDrawable, pDstDrawable,
 		      uxa_drawable_location(pSrcDrawable),
 		      uxa_drawable_location(pDstDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_COPY);
 	if (uxa_prepare_access(pDstDrawable, &dst_region, UXA_ACCESS_RW))
 	{
 	    if (uxa_prepare_access(pSrcDrawable, &src_region, UXA_ACCESS_RO))
@@ -644,12 +653,18 @@ uxa_copy_area(DrawablePtr pSrcDrawable, DrawablePtr pDstDrawable, GCPtr pGC,
 			dstx, dsty, uxa_copy_n_to_n, 0, NULL);
 }
 
+/* Points and line segments are converted to rectangles in chunks of this
+ * size on the stack, rather than allocating one array per request.
+ */
+#define UXA_RECT_BATCH 256
+
 static void
 uxa_poly_point(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
 	       DDXPointPtr ppt)
 {
-	int i;
-	xRectangle *prect;
+	xRectangle rects[UXA_RECT_BATCH];
+	int x = 0, y = 0;
+	int i, j, n;
 
 	/* If we can't reuse the current GC as is, don't bother accelerating the
 	 * points.
@@ -659,35 +674,39 @@ uxa_poly_point(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
 		return;
 	}
 
-	prect = malloc(sizeof(xRectangle) * npt);
-	if (!prect)
-		return;
-	for (i = 0; i < npt; i++) {
-		prect[i].x = ppt[i].x;
-		prect[i].y = ppt[i].y;
-		if (i > 0 && mode == CoordModePrevious) {
-			prect[i].x += prect[i - 1].x;
-			prect[i].y += prect[i - 1].y;
+	UXA_STATS_ACCEL(pDrawable->pScreen, UXA_OP_POLY_POINT);
+	for (i = 0; i < npt; i += n) {
+		n = min(npt - i, UXA_RECT_BATCH);
+		for (j = 0; j < n; j++) {
+			if (mode == CoordModePrevious && i + j > 0) {
+				x += ppt[i + j].x;
+				y += ppt[i + j].y;
+			} else {
+				x = ppt[i + j].x;
+				y = ppt[i + j].y;
+			}
+			rects[j].x = x;
+			rects[j].y = y;
+			rects[j].width = 1;
+			rects[j].height = 1;
 		}
-		prect[i].width = 1;
-		prect[i].height = 1;
+		pGC->ops->PolyFillRect(pDrawable, pGC, n, rects);
 	}
-	pGC->ops->PolyFillRect(pDrawable, pGC, npt, prect);
-	free(prect);
 }
 
 /**
- * uxa_poly_lines() checks if it can accelerate the lines as a group of
- * horizontal or vertical lines (rectangles), and uses existing rectangle fill
- * acceleration if so.
+ * uxa_poly_lines() accelerates the lines as a group of horizontal or
+ * vertical lines (rectangles) using the rectangle fill acceleration.  If
+ * any line is diagonal, the whole polyline is rasterized by miZeroLine()
+ * into spans, which go through uxa_fill_spans().
  */
 static void
 uxa_poly_lines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
 	       DDXPointPtr ppt)
 {
-	xRectangle *prect;
+	xRectangle rects[UXA_RECT_BATCH];
 	int x1, x2, y1, y2;
-	int i;
+	int i, n;
 
 	/* Don't try to do wide lines or non-solid fill style. */
 	if (pGC->lineWidth != 0 || pGC->lineStyle != LineSolid ||
@@ -696,12 +715,8 @@ uxa_poly_lines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
 		return;
 	}
 
-	prect = malloc(sizeof(xRectangle) * (npt - 1));
-	if (!prect)
-		return;
 	x1 = ppt[0].x;
 	y1 = ppt[0].y;
-	/* If we have any non-horizontal/vertical, fall back. */
 	for (i = 0; i < npt - 1; i++) {
 		if (mode == CoordModePrevious) {
 			x2 = x1 + ppt[i + 1].x;
@@ -712,43 +727,65 @@ uxa_poly_lines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
 		}
 
 		if (x1 != x2 && y1 != y2) {
-			free(prect);
-			uxa_check_poly_lines(pDrawable, pGC, mode, npt, ppt);
+			UXA_STATS_ACCEL(pDrawable->pScreen, UXA_OP_POLY_LINES);
+			miZeroLine(pDrawable, pGC, mode, npt, ppt);
 			return;
 		}
 
+		x1 = x2;
+		y1 = y2;
+	}
+
+	UXA_STATS_ACCEL(pDrawable->pScreen, UXA_OP_POLY_LINES);
+	x1 = ppt[0].x;
+	y1 = ppt[0].y;
+	n = 0;
+	for (i = 0; i < npt - 1; i++) {
+		if (mode == CoordModePrevious) {
+			x2 = x1 + ppt[i + 1].x;
+			y2 = y1 + ppt[i + 1].y;
+		} else {
+			x2 = ppt[i + 1].x;
+			y2 = ppt[i + 1].y;
+		}
+
 		if (x1 < x2) {
-			prect[i].x = x1;
-			prect[i].width = x2 - x1 + 1;
+			rects[n].x = x1;
+			rects[n].width = x2 - x1 + 1;
 		} else {
-			prect[i].x = x2;
-			prect[i].width = x1 - x2 + 1;
+			rects[n].x = x2;
+			rects[n].width = x1 - x2 + 1;
 		}
 		if (y1 < y2) {
-			prect[i].y = y1;
-			prect[i].height = y2 - y1 + 1;
+			rects[n].y = y1;
+			rects[n].height = y2 - y1 + 1;
 		} else {
-			prect[i].y = y2;
-			prect[i].height = y1 - y2 + 1;
+			rects[n].y = y2;
+			rects[n].height = y1 - y2 + 1;
+		}
+
+		if (++n == UXA_RECT_BATCH) {
+			pGC->ops->PolyFillRect(pDrawable, pGC, n, rects);
+			n = 0;
 		}
 
 		x1 = x2;
 		y1 = y2;
 	}
-	pGC->ops->PolyFillRect(pDrawable, pGC, npt - 1, prect);
-	free(prect);
+	if (n)
+		pGC->ops->PolyFillRect(pDrawable, pGC, n, rects);
 }
 
 /**
- * uxa_poly_segment() checks if it can accelerate the lines as a group of
- * horizontal or vertical lines (rectangles), and uses existing rectangle fill
- * acceleration if so.
+ * uxa_poly_segment() accelerates horizontal and vertical segments as
+ * rectangles using the rectangle fill acceleration; diagonal segments are
+ * drawn as two-point polylines.
  */
 static void
 uxa_poly_segment(DrawablePtr pDrawable, GCPtr pGC, int nseg, xSegment * pSeg)
 {
-	xRectangle *prect;
-	int i;
+	xRectangle rects[UXA_RECT_BATCH];
+	int i, n;
 
 	/* Don't try to do wide lines or non-solid fill style. */
 	if (pGC->lineWidth != 0 || pGC->lineStyle != LineSolid ||
@@ -757,43 +794,52 @@ uxa_poly_segment(DrawablePtr pDrawable, GCPtr pGC, int nseg, xSegment * pSeg)
 		return;
 	}
 
-	/* If we have any non-horizontal/vertical, fall back. */
+	UXA_STATS_ACCEL(pDrawable->pScreen, UXA_OP_POLY_SEGMENT);
+	n = 0;
 	for (i = 0; i < nseg; i++) {
+		xRectangle *r = &rects[n];
+
 		if (pSeg[i].x1 != pSeg[i].x2 && pSeg[i].y1 != pSeg[i].y2) {
-			uxa_check_poly_segment(pDrawable, pGC, nseg, pSeg);
-			return;
+			DDXPointRec pt[2];
+
+			pt[0].x = pSeg[i].x1;
+			pt[0].y = pSeg[i].y1;
+			pt[1].x = pSeg[i].x2;
+			pt[1].y = pSeg[i].y2;
+			miZeroLine(pDrawable, pGC, CoordModeOrigin, 2, pt);
+			continue;
 		}
-	}
 
-	prect = malloc(sizeof(xRectangle) * nseg);
-	if (!prect)
-		return;
-	for (i = 0; i < nseg; i++) {
 		if (pSeg[i].x1 < pSeg[i].x2) {
-			prect[i].x = pSeg[i].x1;
-			prect[i].width = pSeg[i].x2 - pSeg[i].x1 + 1;
+			r->x = pSeg[i].x1;
+			r->width = pSeg[i].x2 - pSeg[i].x1 + 1;
 		} else {
-			prect[i].x = pSeg[i].x2;
-			prect[i].width = pSeg[i].x1 - pSeg[i].x2 + 1;
+			r->x = pSeg[i].x2;
+			r->width = pSeg[i].x1 - pSeg[i].x2 + 1;
 		}
 		if (pSeg[i].y1 < pSeg[i].y2) {
-			prect[i].y = pSeg[i].y1;
-			prect[i].height = pSeg[i].y2 - pSeg[i].y1 + 1;
+			r->y = pSeg[i].y1;
+			r->height = pSeg[i].y2 - pSeg[i].y1 + 1;
 		} else {
-			prect[i].y = pSeg[i].y2;
-			prect[i].height = pSeg[i].y1 - pSeg[i].y2 + 1;
+			r->y = pSeg[i].y2;
+			r->height = pSeg[i].y1 - pSeg[i].y2 + 1;
 		}
 
 		/* don't paint last pixel */
 		if (pGC->capStyle == CapNotLast) {
-			if (prect[i].width == 1)
-				prect[i].height--;
+			if (r->width == 1)
+				r->height--;
 			else
-				prect[i].width--;
+				r->width--;
+		}
+
+		if (++n == UXA_RECT_BATCH) {
+			pGC->ops->PolyFillRect(pDrawable, pGC, n, rects);
+			n = 0;
 		}
 	}
-	pGC->ops->PolyFillRect(pDrawable, pGC, nseg, prect);
-	free(prect);
+	if (n)
+		pGC->ops->PolyFillRect(pDrawable, pGC, n, rects);
 }
 
 static Bool uxa_fill_region_solid(DrawablePtr pDrawable, RegionPtr pRegion,
@@ -846,6 +892,7 @@ uxa_poly_fill_rect(DrawablePtr pDrawable,
 			&& uxa_fill_region_tiled(pDrawable, pReg,
 						 pGC->tile.pixmap, &pGC->patOrg,
 						 pGC->planemask, pGC->alu))) {
+			UXA_STATS_ACCEL(pDrawable->pScreen, UXA_OP_POLY_FILL_RECT);
 			goto out;
 		}
 	}
@@ -943,6 +990,7 @@ fallback:
 		}
 	}
 	(*uxa_screen->info->done_solid) (pPixmap);
+	UXA_STATS_ACCEL(pDrawable->pScreen, UXA_OP_POLY_FILL_RECT);
 
 out:
 	REGION_UNINIT(pScreen, pReg);
@@ -1290,7 +1338,7 @@ uxa_get_image(DrawablePtr pDrawable, int x, int y, int w, int h,
 
 	uxa_get_drawable_deltas(pDrawable, pPix, &xoff, &yoff);
 
-	Box.x1 = pDrawable->y + x + xoff;
+	Box.x1 = pDrawable->x + x + xoff;
 	Box.y1 = pDrawable->y + y + yoff;
 	Box.x2 = Box.x1 + w;
 	Box.y2 = Box.y1 + h;
@@ -1316,12 +1364,15 @@ uxa_get_image(DrawablePtr pDrawable, int x, int y, int w, int h,
 	ok = uxa_screen->info->get_image(pPix, pDrawable->x + x + xoff,
 					 pDrawable->y + y + yoff, w, h, d,
 					 PixmapBytePad(w, pDrawable->depth));
-	if (ok)
+	if (ok) {
+		UXA_STATS_ACCEL(screen, UXA_OP_GET_IMAGE);
 		return;
+	}
 
 fallback:
 	UXA_FALLBACK(("from %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_GET_IMAGE);
 
 	REGION_INIT(screen, &region, &Box, 1);
 	
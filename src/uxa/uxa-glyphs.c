@@ -347,25 +347,47 @@ uxa_glyph_extents(int nlist,
 	extents->y2 = y2 > MAXSHORT ? MAXSHORT : y2;
 }
 
+static int
+uxa_glyph_box_cmp_x(const void *a, const void *b)
+{
+	return ((const BoxRec *) a)->x1 - ((const BoxRec *) b)->x1;
+}
+
+static int
+uxa_glyph_box_cmp_y(const void *a, const void *b)
+{
+	return ((const BoxRec *) a)->y1 - ((const BoxRec *) b)->y1;
+}
+
 /**
- * Returns TRUE if the glyphs in the lists intersect.  Only checks based on
- * bounding box, which appears to be good enough to catch most cases at least.
+ * Returns TRUE if any two glyph boxes in the lists intersect.
+ *
+ * The boxes are first checked against the running extents of the
+ * preceding ones, which clears a single line of text in one pass.  Runs
+ * that fail that test (several lines, kerning, right-to-left) are sorted
+ * along their longer axis and swept, so only boxes that overlap along
+ * that axis are compared.
  */
 static Bool
 uxa_glyphs_intersect(int nlist, GlyphListPtr list, GlyphPtr * glyphs)
 {
-	int x1, x2, y1, y2;
-	int n;
-	int x, y;
-	BoxRec extents;
-	Bool first = TRUE;
+	BoxRec stack_boxes[64], *boxes = stack_boxes;
+	BoxRec extents = { 0, 0, 0, 0 };
+	Bool maybe = FALSE, ret = FALSE;
+	int nglyphs = 0, nbox = 0;
+	int x, y, n, i, j;
+
+	for (i = 0; i < nlist; i++)
+		nglyphs += list[i].len;
+
+	if (nglyphs > sizeof(stack_boxes) / sizeof(stack_boxes[0])) {
+		boxes = malloc(nglyphs * sizeof(BoxRec));
+		if (boxes == NULL)
+			return TRUE;
+	}
 
 	x = 0;
 	y = 0;
-	extents.x1 = 0;
-	extents.y1 = 0;
-	extents.x2 = 0;
-	extents.y2 = 0;
 	while (nlist--) {
 		x += list->xOff;
 		y += list->yOff;
@@ -373,6 +395,7 @@ uxa_glyphs_intersect(int nlist, GlyphListPtr list, GlyphPtr * glyphs)
 		list++;
 		while (n--) {
 			GlyphPtr glyph = *glyphs++;
+			BoxPtr box;
 
 			if (glyph->info.width == 0 || glyph->info.height == 0) {
 				x += glyph->info.xOff;
@@ -380,46 +403,115 @@ uxa_glyphs_intersect(int nlist, GlyphListPtr list, GlyphPtr * glyphs)
 				continue;
 			}
 
-			x1 = x - glyph->info.x;
-			if (x1 < MINSHORT)
-				x1 = MINSHORT;
-			y1 = y - glyph->info.y;
-			if (y1 < MINSHORT)
-				y1 = MINSHORT;
-			x2 = x1 + glyph->info.width;
-			if (x2 > MAXSHORT)
-				x2 = MAXSHORT;
-			y2 = y1 + glyph->info.height;
-			if (y2 > MAXSHORT)
-				y2 = MAXSHORT;
-
-			if (first) {
-				extents.x1 = x1;
-				extents.y1 = y1;
-				extents.x2 = x2;
-				extents.y2 = y2;
-				first = FALSE;
-			} else {
-				if (x1 < extents.x2 && x2 > extents.x1 &&
-				    y1 < extents.y2 && y2 > extents.y1) {
-					return TRUE;
-				}
+			box = &boxes[nbox];
+			box->x1 = max(x - glyph->info.x, MINSHORT);
+			box->y1 = max(y - glyph->info.y, MINSHORT);
+			box->x2 = min(box->x1 + glyph->info.width, MAXSHORT);
+			box->y2 = min(box->y1 + glyph->info.height, MAXSHORT);
 
-				if (x1 < extents.x1)
-					extents.x1 = x1;
-				if (x2 > extents.x2)
-					extents.x2 = x2;
-				if (y1 < extents.y1)
-					extents.y1 = y1;
-				if (y2 > extents.y2)
-					extents.y2 = y2;
+			if (nbox++ == 0) {
+				extents = *box;
+			} else {
+				if (box->x1 < extents.x2 && box->x2 > extents.x1 &&
+				    box->y1 < extents.y2 && box->y2 > extents.y1)
+					maybe = TRUE;
+
+				if (box->x1 < extents.x1)
+					extents.x1 = box->x1;
+				if (box->x2 > extents.x2)
+					extents.x2 = box->x2;
+				if (box->y1 < extents.y1)
+					extents.y1 = box->y1;
+				if (box->y2 > extents.y2)
+					extents.y2 = box->y2;
 			}
+
 			x += glyph->info.xOff;
 			y += glyph->info.yOff;
 		}
 	}
 
-	return FALSE;
+	if (!maybe)
+		goto out;
+
+	if (extents.x2 - extents.x1 >= extents.y2 - extents.y1) {
+		qsort(boxes, nbox, sizeof(BoxRec), uxa_glyph_box_cmp_x);
+		for (i = 0; i < nbox && !ret; i++)
+			for (j = i + 1; j < nbox && boxes[j].x1 < boxes[i].x2; j++)
+				if (boxes[j].y1 < boxes[i].y2 &&
+				    boxes[j].y2 > boxes[i].y1) {
+					ret = TRUE;
+					break;
+				}
+	} else {
+		qsort(boxes, nbox, sizeof(BoxRec), uxa_glyph_box_cmp_y);
+		for (i = 0; i < nbox && !ret; i++)
+			for (j = i + 1; j < nbox && boxes[j].y1 < boxes[i].y2; j++)
+				if (boxes[j].x1 < boxes[i].x2 &&
+				    boxes[j].x2 > boxes[i].x1) {
+					ret = TRUE;
+					break;
+				}
+	}
+
+out:
+	if (boxes != stack_boxes)
+		free(boxes);
+	return ret;
+}
+
+/* Relative costs, in pixels touched, of the work in the two glyph paths */
+#define UXA_GLYPH_OP_COST	64	/* per composite operation */
+#define UXA_GLYPH_MASK_COST	4096	/* creating the mask pixmap and picture */
+
+/**
+ * Estimates whether rendering the run through a temporary mask is cheaper
+ * than compositing each glyph straight onto the destination.
+ *
+ * The mask path clears the mask, adds each glyph into it and then
+ * composites the whole extents once.  The direct path composites each
+ * glyph, with two passes per glyph for component-alpha Over.
+ */
+static Bool
+uxa_glyphs_mask_is_cheaper(CARD8 op, PictFormatPtr maskFormat,
+			   int nlist, GlyphListPtr list, GlyphPtr * glyphs)
+{
+	int passes = 1;
+	long glyph_area = 0, extents_area;
+	long nglyphs = 0;
+	long direct, masked;
+	GlyphPtr *g = glyphs;
+	BoxRec extents;
+	int i;
+
+	if (op == PictOpOver && NeedsComponent(maskFormat->format))
+		passes = 2;
+
+	for (i = 0; i < nlist; i++) {
+		int n = list[i].len;
+
+		while (n--) {
+			GlyphPtr glyph = *g++;
+
+			if (glyph->info.width == 0 || glyph->info.height == 0)
+				continue;
+
+			glyph_area += glyph->info.width * glyph->info.height;
+			nglyphs++;
+		}
+	}
+
+	uxa_glyph_extents(nlist, list, glyphs, &extents);
+	if (extents.x2 <= extents.x1 || extents.y2 <= extents.y1)
+		return FALSE;
+	extents_area = (long)(extents.x2 - extents.x1) * (extents.y2 - extents.y1);
+
+	direct = passes * (nglyphs * UXA_GLYPH_OP_COST + glyph_area);
+	masked = UXA_GLYPH_MASK_COST + extents_area +
+		nglyphs * UXA_GLYPH_OP_COST + glyph_area +
+		passes * (UXA_GLYPH_OP_COST + extents_area);
+
+	return masked < direct;
 }
 
 static void
@@ -644,6 +736,65 @@ uxa_glyph_cache(ScreenPtr screen, GlyphPtr glyph, int *out_x, int *out_y)
 	return cache->picture;
 }
 
+/* Uploads every glyph of the run that is not yet in a cache, so that the
+ * run can then be drawn from the atlases without breaking the batch for
+ * uploads.  A glyph evicted again by a later one in the same run is
+ * simply uploaded again when it is drawn.
+ */
+static void
+uxa_glyphs_prime_cache(ScreenPtr screen,
+		       int nlist, GlyphListPtr list, GlyphPtr * glyphs)
+{
+	int n, x, y;
+
+	while (nlist--) {
+		n = list->len;
+		while (n--) {
+			GlyphPtr glyph = *glyphs++;
+
+			if (glyph->info.width == 0 || glyph->info.height == 0)
+				continue;
+
+			if (uxa_glyph_get_private(glyph) == NULL)
+				uxa_glyph_cache(screen, glyph, &x, &y);
+		}
+		list++;
+	}
+}
+
+static inline void
+uxa_glyphs_add_rect(uxa_screen_t *uxa_screen, PixmapPtr pixmap,
+		    uxa_composite_rect_t *rects, int *nrect,
+		    int src_x, int src_y, int mask_x, int mask_y,
+		    int dst_x, int dst_y, int width, int height)
+{
+	uxa_composite_rect_t *r;
+
+	if (*nrect == UXA_COMPOSITE_BATCH) {
+		uxa_composite_emit_rects(uxa_screen, pixmap, *nrect, rects);
+		*nrect = 0;
+	}
+
+	r = &rects[(*nrect)++];
+	r->xSrc = src_x;
+	r->ySrc = src_y;
+	r->xMask = mask_x;
+	r->yMask = mask_y;
+	r->xDst = dst_x;
+	r->yDst = dst_y;
+	r->width = width;
+	r->height = height;
+}
+
+static inline void
+uxa_glyphs_done(uxa_screen_t *uxa_screen, PixmapPtr pixmap,
+		uxa_composite_rect_t *rects, int *nrect)
+{
+	uxa_composite_emit_rects(uxa_screen, pixmap, *nrect, rects);
+	*nrect = 0;
+	uxa_screen->info->done_composite(pixmap);
+}
+
 static int
 uxa_glyphs_to_dst(CARD8 op,
 		  PicturePtr pSrc,
@@ -657,7 +808,8 @@ uxa_glyphs_to_dst(CARD8 op,
 	uxa_screen_t *uxa_screen = uxa_get_screen(screen);
 	PixmapPtr src_pixmap, dst_pixmap;
 	PicturePtr localSrc, glyph_atlas;
-	int x, y, n, nrect;
+	uxa_composite_rect_t rects[UXA_COMPOSITE_BATCH];
+	int x, y, n, nrect, nbatch = 0;
 	BoxRec box;
 
 	if (uxa_screen->info->check_composite_texture &&
@@ -729,6 +881,8 @@ uxa_glyphs_to_dst(CARD8 op,
 		}
 	}
 
+	uxa_glyphs_prime_cache(screen, nlist, list, glyphs);
+
 	dst_pixmap = uxa_get_offscreen_pixmap(pDst->pDrawable, &x, &y);
 	x += xDst + pDst->pDrawable->x - list->xOff;
 	y += yDst + pDst->pDrawable->y - list->yOff;
@@ -754,7 +908,8 @@ uxa_glyphs_to_dst(CARD8 op,
 				this_atlas = priv->cache->picture;
 			} else {
 				if (glyph_atlas) {
-					uxa_screen->info->done_composite(dst_pixmap);
+					uxa_glyphs_done(uxa_screen, dst_pixmap,
+							rects, &nbatch);
 					glyph_atlas = NULL;
 				}
 				this_atlas = uxa_glyph_cache(screen, glyph, &mask_x, &mask_y);
@@ -769,7 +924,8 @@ uxa_glyphs_to_dst(CARD8 op,
 				PixmapPtr mask_pixmap;
 
 				if (glyph_atlas)
-					uxa_screen->info->done_composite(dst_pixmap);
+					uxa_glyphs_done(uxa_screen, dst_pixmap,
+							rects, &nbatch);
 
 				mask_pixmap =
 					uxa_get_drawable_pixmap(this_atlas->pDrawable);
@@ -785,38 +941,40 @@ uxa_glyphs_to_dst(CARD8 op,
 
 			nrect = REGION_NUM_RECTS(pDst->pCompositeClip);
 			if (nrect == 1) {
-				uxa_screen->info->composite(dst_pixmap,
-							    x + src_x, y + src_y,
-							    mask_x, mask_y,
-							    x - glyph->info.x,
-							    y - glyph->info.y,
-							    glyph->info.width,
-							    glyph->info.height);
+				uxa_glyphs_add_rect(uxa_screen, dst_pixmap,
+						    rects, &nbatch,
+						    x + src_x, y + src_y,
+						    mask_x, mask_y,
+						    x - glyph->info.x,
+						    y - glyph->info.y,
+						    glyph->info.width,
+						    glyph->info.height);
 			} else {
-				BoxPtr rects = REGION_RECTS(pDst->pCompositeClip);
+				BoxPtr clip = REGION_RECTS(pDst->pCompositeClip);
 				do {
 					int x1 = x - glyph->info.x, dx = 0;
 					int y1 = y - glyph->info.y, dy = 0;
 					int x2 = x1 + glyph->info.width;
 					int y2 = y1 + glyph->info.height;
 
-					if (x1 < rects->x1)
-						dx = rects->x1 - x1, x1 = rects->x1;
-					if (x2 > rects->x2)
-						x2 = rects->x2;
-					if (y1 < rects->y1)
-						dy = rects->y1 - y1, y1 = rects->y1;
-					if (y2 > rects->y2)
-						y2 = rects->y2;
+					if (x1 < clip->x1)
+						dx = clip->x1 - x1, x1 = clip->x1;
+					if (x2 > clip->x2)
+						x2 = clip->x2;
+					if (y1 < clip->y1)
+						dy = clip->y1 - y1, y1 = clip->y1;
+					if (y2 > clip->y2)
+						y2 = clip->y2;
 
 					if (x1 < x2 && y1 < y2) {
-						uxa_screen->info->composite(dst_pixmap,
-									    x1 + src_x, y1 + src_y,
-									    dx + mask_x, dy + mask_y,
-									    x1, y1,
-									    x2 - x1, y2 - y1);
+						uxa_glyphs_add_rect(uxa_screen, dst_pixmap,
+								    rects, &nbatch,
+								    x1 + src_x, y1 + src_y,
+								    dx + mask_x, dy + mask_y,
+								    x1, y1,
+								    x2 - x1, y2 - y1);
 					}
-					rects++;
+					clip++;
 				} while (--nrect);
 			}
 
@@ -827,7 +985,7 @@ next_glyph:
 		list++;
 	}
 	if (glyph_atlas)
-		uxa_screen->info->done_composite(dst_pixmap);
+		uxa_glyphs_done(uxa_screen, dst_pixmap, rects, &nbatch);
 
 	if (localSrc != pSrc)
 		FreePicture(localSrc, 0);
@@ -891,7 +1049,8 @@ uxa_glyphs_via_mask(CARD8 op,
 	CARD32 component_alpha;
 	PixmapPtr pixmap;
 	PicturePtr glyph_atlas, mask;
-	int x, y, width, height;
+	uxa_composite_rect_t rects[UXA_COMPOSITE_BATCH];
+	int x, y, width, height, nbatch = 0;
 	int dst_off_x, dst_off_y;
 	int n, error;
 	BoxRec box;
@@ -948,6 +1107,8 @@ uxa_glyphs_via_mask(CARD8 op,
 
 	ValidatePicture(mask);
 
+	uxa_glyphs_prime_cache(screen, nlist, list, glyphs);
+
 	glyph_atlas = NULL;
 	while (nlist--) {
 		x += list->xOff;
@@ -969,7 +1130,8 @@ uxa_glyphs_via_mask(CARD8 op,
 				this_atlas = priv->cache->picture;
 			} else {
 				if (glyph_atlas) {
-					uxa_screen->info->done_composite(pixmap);
+					uxa_glyphs_done(uxa_screen, pixmap,
+							rects, &nbatch);
 					glyph_atlas = NULL;
 				}
 				this_atlas = uxa_glyph_cache(screen, glyph, &src_x, &src_y);
@@ -984,7 +1146,8 @@ uxa_glyphs_via_mask(CARD8 op,
 				PixmapPtr src_pixmap;
 
 				if (glyph_atlas)
-					uxa_screen->info->done_composite(pixmap);
+					uxa_glyphs_done(uxa_screen, pixmap,
+							rects, &nbatch);
 
 				src_pixmap =
 					uxa_get_drawable_pixmap(this_atlas->pDrawable);
@@ -1000,13 +1163,14 @@ uxa_glyphs_via_mask(CARD8 op,
 				glyph_atlas = this_atlas;
 			}
 
-			uxa_screen->info->composite(pixmap,
-						    src_x, src_y,
-						    0, 0,
-						    x - glyph->info.x,
-						    y - glyph->info.y,
-						    glyph->info.width,
-						    glyph->info.height);
+			uxa_glyphs_add_rect(uxa_screen, pixmap,
+					    rects, &nbatch,
+					    src_x, src_y,
+					    0, 0,
+					    x - glyph->info.x,
+					    y - glyph->info.y,
+					    glyph->info.width,
+					    glyph->info.height);
 
 next_glyph:
 			x += glyph->info.xOff;
@@ -1015,7 +1179,7 @@ next_glyph:
 		list++;
 	}
 	if (glyph_atlas)
-		uxa_screen->info->done_composite(pixmap);
+		uxa_glyphs_done(uxa_screen, pixmap, rects, &nbatch);
 
 	uxa_composite(op,
 		      pSrc, mask, pDst,
@@ -1051,6 +1215,7 @@ uxa_glyphs(CARD8 op,
 	    !uxa_drawable_is_offscreen(pDst->pDrawable) ||
 	    pDst->alphaMap || pSrc->alphaMap) {
 fallback:
+	    UXA_STATS_FALLBACK(screen, UXA_OP_GLYPHS);
 	    uxa_check_glyphs(op, pSrc, pDst, maskFormat, xSrc, ySrc, nlist, list, glyphs);
 	    return;
 	}
@@ -1083,9 +1248,32 @@ fallback:
 			}
 
 			if (!sameFormat ||
+			    !uxa_glyphs_mask_is_cheaper(op, maskFormat,
+							nlist, list, glyphs) ||
 			    uxa_glyphs_intersect(nlist, list, glyphs))
 				maskFormat = NULL;
 		}
+	} else if ((op == PictOpOver || op == PictOpAdd) &&
+		   !NeedsComponent(maskFormat->format)) {
+		/* Without overlaps, and with glyphs already in the mask
+		 * format, compositing each glyph directly gives the same
+		 * result as going through the mask.
+		 */
+		Bool sameFormat = TRUE;
+		int i;
+
+		for (i = 0; i < nlist; i++) {
+			if (maskFormat->format != list[i].format->format) {
+				sameFormat = FALSE;
+				break;
+			}
+		}
+
+		if (sameFormat &&
+		    !uxa_glyphs_mask_is_cheaper(op, maskFormat,
+						nlist, list, glyphs) &&
+		    !uxa_glyphs_intersect(nlist, list, glyphs))
+			maskFormat = NULL;
 	}
 
 	if (!maskFormat &&
@@ -1191,4 +1379,6 @@ fallback:
 
 		FreePicture(localDst, 0);
 	}
+
+	UXA_STATS_ACCEL(screen, UXA_OP_GLYPHS);
 }
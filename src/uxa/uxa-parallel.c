@@ -0,0 +1,237 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * Parallel software fallbacks.
+ *
+ * Large fallbacks are split into horizontal bands of the destination
+ * which are rendered by a small pool of worker threads, the calling
+ * thread taking bands as well.  uxa_parallel_run() only returns once
+ * every band is done, so callers finish access right after it as
+ * before.  The band functions may only touch pixman images and memory
+ * set up by the caller, never server state.
+ */
+
+#include "uxa-priv.h"
+
+#ifdef HAVE_PTHREAD_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+struct uxa_parallel {
+	pthread_t threads[UXA_PARALLEL_MAX_THREADS];
+	int nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+
+	/* the current job; bands are handed out from next up to y2 */
+	uxa_band_func_t func;
+	void *closure;
+	int next, y2, band;
+	int pending;
+	Bool quit;
+};
+
+/* Called with the lock held; returns with it held. */
+static Bool
+uxa_parallel_take_band(struct uxa_parallel *pool)
+{
+	uxa_band_func_t func = pool->func;
+	void *closure = pool->closure;
+	int y1, y2;
+
+	if (pool->next >= pool->y2)
+		return FALSE;
+
+	y1 = pool->next;
+	y2 = min(y1 + pool->band, pool->y2);
+	pool->next = y2;
+	pool->pending++;
+	pthread_mutex_unlock(&pool->lock);
+
+	func(closure, y1, y2);
+
+	pthread_mutex_lock(&pool->lock);
+	if (--pool->pending == 0 && pool->next >= pool->y2)
+		pthread_cond_signal(&pool->done);
+	return TRUE;
+}
+
+static void *
+uxa_parallel_thread(void *closure)
+{
+	struct uxa_parallel *pool = closure;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->quit) {
+		if (!uxa_parallel_take_band(pool))
+			pthread_cond_wait(&pool->work, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static struct uxa_parallel *
+uxa_parallel_create(void)
+{
+	struct uxa_parallel *pool;
+	sigset_t all, saved;
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 2)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	while (pool->nthreads < ncpus - 1 &&
+	       pool->nthreads < UXA_PARALLEL_MAX_THREADS) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+				   uxa_parallel_thread, pool))
+			break;
+		pool->nthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (!pool->nthreads) {
+		pthread_cond_destroy(&pool->done);
+		pthread_cond_destroy(&pool->work);
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * Runs func over the rows [y1, y2) in bands, in parallel if the area is
+ * big enough to be worth it.
+ *
+ * The first band always runs on the calling thread before any other
+ * starts, so that state computed lazily on first use (pixman validates
+ * images on their first composite) exists before it is shared.
+ *
+ * @return FALSE, without having called func, if the caller should do
+ * the operation serially itself.
+ */
+Bool
+uxa_parallel_run(ScreenPtr screen, int y1, int y2, int width,
+		 uxa_band_func_t func, void *closure)
+{
+	uxa_screen_t *uxa_screen = uxa_get_screen(screen);
+	struct uxa_parallel *pool;
+	int height = y2 - y1;
+	int band;
+
+	if (height < 2 || width <= 0 ||
+	    (int64_t) width * height < UXA_PARALLEL_MIN_PIXELS)
+		return FALSE;
+
+	if (!uxa_screen->parallel && !uxa_screen->parallel_disabled) {
+		uxa_screen->parallel = uxa_parallel_create();
+		uxa_screen->parallel_disabled = !uxa_screen->parallel;
+	}
+	pool = uxa_screen->parallel;
+	if (!pool)
+		return FALSE;
+
+	/* a few bands per thread so that uneven bands even out */
+	band = (height + 4 * (pool->nthreads + 1) - 1) /
+		(4 * (pool->nthreads + 1));
+	if (band < UXA_PARALLEL_MIN_BAND)
+		band = UXA_PARALLEL_MIN_BAND;
+
+	func(closure, y1, min(y1 + band, y2));
+	if (y1 + band >= y2)
+		return TRUE;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->closure = closure;
+	pool->next = y1 + band;
+	pool->y2 = y2;
+	pool->band = band;
+	pool->pending = 0;
+	pthread_cond_broadcast(&pool->work);
+
+	while (uxa_parallel_take_band(pool))
+		;
+	while (pool->pending)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	return TRUE;
+}
+
+void
+uxa_parallel_fini(ScreenPtr screen)
+{
+	uxa_screen_t *uxa_screen = uxa_get_screen(screen);
+	struct uxa_parallel *pool = uxa_screen->parallel;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = TRUE;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	uxa_screen->parallel = NULL;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+Bool
+uxa_parallel_run(ScreenPtr screen, int y1, int y2, int width,
+		 uxa_band_func_t func, void *closure)
+{
+	return FALSE;
+}
+
+void
+uxa_parallel_fini(ScreenPtr screen)
+{
+}
+
+#endif
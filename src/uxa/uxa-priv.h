@@ -86,6 +86,9 @@ if (uxa_get_screen(screen)->fallback_debug) {			\
 	ErrorF x;						\
 }
 
+#define UXA_STATS_ACCEL(s, op)  (uxa_get_screen(s)->stats.accel[op]++)
+#define UXA_STATS_FALLBACK(s, op)  (uxa_get_screen(s)->stats.fallback[op]++)
+
 char uxa_drawable_location(DrawablePtr pDrawable);
 
 #if DEBUG_PIXMAP
@@ -110,6 +113,24 @@ typedef struct {
 
 #define UXA_NUM_SOLID_CACHE 16
 
+typedef struct {
+	uint64_t hash;
+	uint8_t *key;		/* see uxa_gradient_key() */
+	size_t key_size;
+	PicturePtr picture;
+} uxa_gradient_cache_t;
+
+#define UXA_NUM_GRADIENT_CACHE 16
+/* Larger gradients are rendered per use rather than cached */
+#define UXA_GRADIENT_CACHE_MAX_PIXELS (256 * 256)
+
+/* Fallbacks smaller than this are not worth spreading over threads */
+#define UXA_PARALLEL_MIN_PIXELS (512 * 512)
+#define UXA_PARALLEL_MIN_BAND 16
+#define UXA_PARALLEL_MAX_THREADS 7
+
+struct uxa_parallel;
+
 typedef void (*EnableDisableFBAccessProcPtr) (SCRN_ARG_TYPE, Bool);
 typedef struct {
 	uxa_driver_t *info;
@@ -136,6 +157,7 @@ typedef struct {
 	Bool force_fallback;
 	Bool fallback_debug;
 	Bool swappedOut;
+	uxa_stats_t stats;
 	unsigned disableFbCount;
 	unsigned offScreenCounter;
 
@@ -144,6 +166,12 @@ typedef struct {
 	PicturePtr solid_clear, solid_black, solid_white;
 	uxa_solid_cache_t solid_cache[UXA_NUM_SOLID_CACHE];
 	int solid_cache_size;
+
+	uxa_gradient_cache_t gradient_cache[UXA_NUM_GRADIENT_CACHE];
+	int gradient_cache_size;
+
+	struct uxa_parallel *parallel;
+	Bool parallel_disabled;
 } uxa_screen_t;
 
 /*
@@ -178,14 +206,8 @@ static inline uxa_screen_t *uxa_get_screen(ScreenPtr screen)
 /** Align an offset to a power-of-two alignment */
 #define UXA_ALIGN2(offset, align) (((offset) + (align) - 1) & ~((align) - 1))
 
-typedef struct {
-	INT16 xSrc;
-	INT16 ySrc;
-	INT16 xDst;
-	INT16 yDst;
-	INT16 width;
-	INT16 height;
-} uxa_composite_rect_t;
+/* Rectangles accumulated before handing them to the driver */
+#define UXA_COMPOSITE_BATCH 256
 
 /**
  * exaDDXDriverInit must be implemented by the DDX using EXA, and is the place
@@ -367,9 +389,8 @@ uxa_composite(CARD8 op,
 	      INT16 yMask, INT16 xDst, INT16 yDst, CARD16 width, CARD16 height);
 
 void
-uxa_composite_rects(CARD8 op,
-		    PicturePtr pSrc,
-		    PicturePtr pDst, int nrect, uxa_composite_rect_t * rects);
+uxa_composite_emit_rects(uxa_screen_t *uxa_screen, PixmapPtr pDst,
+			 int nrect, uxa_composite_rect_t *rects);
 
 void
 uxa_solid_rects (CARD8		op,
@@ -413,6 +434,15 @@ uxa_get_rgba_from_pixel(CARD32 pixel,
 			CARD16 * alpha,
 			CARD32 format);
 
+/* uxa-parallel.c */
+typedef void (*uxa_band_func_t) (void *closure, int y1, int y2);
+
+Bool
+uxa_parallel_run(ScreenPtr screen, int y1, int y2, int width,
+		 uxa_band_func_t func, void *closure);
+
+void uxa_parallel_fini(ScreenPtr screen);
+
 /* uxa_glyph.c */
 Bool uxa_glyphs_init(ScreenPtr pScreen);
 
@@ -668,33 +668,217 @@ DONE:
 	return picture;
 }
 
+static uint64_t
+uxa_hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* one walk over a gradient's key: hash it, store it, or compare it */
+typedef struct {
+	uint64_t hash;
+	size_t size;
+	uint8_t *store;
+	const uint8_t *compare;
+	Bool differs;
+} uxa_key_walk_t;
+
+static void
+uxa_key_add(uxa_key_walk_t *key, const void *data, size_t len)
+{
+	if (key->store)
+		memcpy(key->store + key->size, data, len);
+	if (key->compare && !key->differs &&
+	    memcmp(key->compare + key->size, data, len))
+		key->differs = TRUE;
+	key->hash = uxa_hash_bytes(key->hash, data, len);
+	key->size += len;
+}
+
+/**
+ * Walks everything that determines the pixels of a gradient source:
+ * the gradient geometry and stops, the transform, filter and repeat mode,
+ * followed by the area rendered.  Toolkits create a fresh gradient
+ * picture for every draw, so the picture pointer is useless as a cache
+ * key.  The walk leaves the hash and size of the key, and optionally
+ * stores it or compares it against a stored key of the same size.
+ */
+static void
+uxa_gradient_key(PicturePtr pict, const int area[5], uxa_key_walk_t *key)
+{
+	SourcePict *source = pict->pSourcePict;
+	PictGradient *gradient = &source->gradient;
+	int repeat = pict->repeat ? pict->repeatType : -1;
+	int has_transform = pict->transform != NULL;
+
+	uxa_key_add(key, &source->type, sizeof(source->type));
+	switch (source->type) {
+	case SourcePictTypeLinear:
+		uxa_key_add(key, &source->linear.p1,
+			    sizeof(source->linear.p1));
+		uxa_key_add(key, &source->linear.p2,
+			    sizeof(source->linear.p2));
+		break;
+	case SourcePictTypeRadial:
+		uxa_key_add(key, &source->radial.c1,
+			    sizeof(source->radial.c1));
+		uxa_key_add(key, &source->radial.c2,
+			    sizeof(source->radial.c2));
+		break;
+	case SourcePictTypeConical:
+		uxa_key_add(key, &source->conical.center,
+			    sizeof(source->conical.center));
+		uxa_key_add(key, &source->conical.angle,
+			    sizeof(source->conical.angle));
+		break;
+	}
+
+	uxa_key_add(key, &gradient->nstops, sizeof(gradient->nstops));
+	uxa_key_add(key, gradient->stops,
+		    gradient->nstops * sizeof(*gradient->stops));
+	uxa_key_add(key, &has_transform, sizeof(has_transform));
+	if (pict->transform)
+		uxa_key_add(key, pict->transform,
+			    sizeof(*pict->transform));
+	uxa_key_add(key, &pict->filter, sizeof(pict->filter));
+	uxa_key_add(key, &repeat, sizeof(repeat));
+	uxa_key_add(key, area, 5 * sizeof(*area));
+}
+
+/**
+ * Returns TRUE if the gradient only varies along one axis, setting
+ * *vertical if that axis is y.  Such a gradient can be rendered as a
+ * single row or column and repeated by the sampler.
+ */
+static Bool
+uxa_gradient_is_separable(PicturePtr pict, Bool *vertical)
+{
+	SourcePict *source = pict->pSourcePict;
+
+	if (source->type != SourcePictTypeLinear || pict->transform)
+		return FALSE;
+
+	if (source->linear.p1.y == source->linear.p2.y &&
+	    source->linear.p1.x != source->linear.p2.x) {
+		*vertical = FALSE;
+		return TRUE;
+	}
+
+	if (source->linear.p1.x == source->linear.p2.x &&
+	    source->linear.p1.y != source->linear.p2.y) {
+		*vertical = TRUE;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 PicturePtr
 uxa_acquire_pattern(ScreenPtr pScreen,
 		    PicturePtr pSrc,
 		    pixman_format_code_t format,
 		    INT16 x, INT16 y, CARD16 width, CARD16 height)
 {
+	uxa_screen_t *uxa_screen = uxa_get_screen(pScreen);
 	PicturePtr pDst;
+	Bool strip = FALSE, vertical, cache = FALSE;
+	uxa_key_walk_t key = { 0xcbf29ce484222325ULL };
+	uxa_key_walk_t store = { 0 };
+	int area[5] = { 0 };
+	int i;
 
 	if (pSrc->pSourcePict) {
 		SourcePict *source = pSrc->pSourcePict;
 		if (source->type == SourcePictTypeSolidFill)
 			return uxa_acquire_solid (pScreen, source);
+
+		if (uxa_gradient_is_separable(pSrc, &vertical)) {
+			strip = TRUE;
+			if (vertical) {
+				x = 0;
+				width = 1;
+			} else {
+				y = 0;
+				height = 1;
+			}
+		}
+
+		if ((int64_t)width * height <= UXA_GRADIENT_CACHE_MAX_PIXELS) {
+			area[0] = x;
+			area[1] = y;
+			area[2] = width;
+			area[3] = height;
+			area[4] = format;
+
+			uxa_gradient_key(pSrc, area, &key);
+			cache = TRUE;
+
+			/* the hash only saves comparing keys that differ */
+			for (i = 0; i < uxa_screen->gradient_cache_size; i++) {
+				uxa_gradient_cache_t *entry =
+					&uxa_screen->gradient_cache[i];
+				uxa_key_walk_t cmp = { 0 };
+
+				if (entry->hash != key.hash ||
+				    entry->key_size != key.size)
+					continue;
+
+				cmp.compare = entry->key;
+				uxa_gradient_key(pSrc, area, &cmp);
+				if (!cmp.differs) {
+					pDst = entry->picture;
+					pDst->refcnt++;
+					return pDst;
+				}
+			}
+		}
 	}
 
 	pDst = uxa_picture_for_pixman_format(pScreen, format, width, height);
 	if (!pDst)
 		return 0;
 
-	if (uxa_prepare_access(pDst->pDrawable, NULL, UXA_ACCESS_RW)) {
-		fbComposite(PictOpSrc, pSrc, NULL, pDst,
-			    x, y, 0, 0, 0, 0, width, height);
-		uxa_finish_access(pDst->pDrawable);
-		return pDst;
-	} else {
+	if (!uxa_prepare_access(pDst->pDrawable, NULL, UXA_ACCESS_RW)) {
 		FreePicture(pDst, 0);
 		return 0;
 	}
+
+	fbComposite(PictOpSrc, pSrc, NULL, pDst,
+		    x, y, 0, 0, 0, 0, width, height);
+	uxa_finish_access(pDst->pDrawable);
+
+	if (strip) {
+		pDst->repeat = 1;
+		pDst->repeatType = RepeatNormal;
+	}
+
+	/* only a new entry pays for storing its key */
+	if (cache)
+		store.store = malloc(key.size);
+	if (store.store) {
+		uxa_gradient_key(pSrc, area, &store);
+
+		if (uxa_screen->gradient_cache_size == UXA_NUM_GRADIENT_CACHE) {
+			i = rand() % UXA_NUM_GRADIENT_CACHE;
+			FreePicture(uxa_screen->gradient_cache[i].picture, 0);
+			free(uxa_screen->gradient_cache[i].key);
+		} else
+			i = uxa_screen->gradient_cache_size++;
+
+		uxa_screen->gradient_cache[i].hash = key.hash;
+		uxa_screen->gradient_cache[i].key = store.store;
+		uxa_screen->gradient_cache[i].key_size = key.size;
+		uxa_screen->gradient_cache[i].picture = pDst;
+		pDst->refcnt++;
+	}
+
+	return pDst;
 }
 
 static Bool
@@ -1062,6 +1246,7 @@ try_solid:
 	}
 
 	pixman_region_fini(&region);
+	UXA_STATS_ACCEL(screen, UXA_OP_SOLID_RECTS);
 	return;
 
 err_src:
@@ -1069,6 +1254,7 @@ err_src:
 err_region:
 	pixman_region_fini(&region);
 fallback:
+	UXA_STATS_FALLBACK(screen, UXA_OP_SOLID_RECTS);
 	uxa_screen->SavedCompositeRects(op, dst, color, num_rects, rects);
 }
 
@@ -1086,7 +1272,8 @@ uxa_try_driver_composite(CARD8 op,
 	uxa_screen_t *uxa_screen = uxa_get_screen(screen);
 	RegionRec region;
 	BoxPtr pbox;
-	int nbox;
+	int nbox, n;
+	uxa_composite_rect_t batch[UXA_COMPOSITE_BATCH];
 	int xDst_copy, yDst_copy;
 	int src_off_x, src_off_y, mask_off_x, mask_off_y, dst_off_x, dst_off_y;
 	PixmapPtr pSrcPix, pMaskPix = NULL, pDstPix;
@@ -1251,20 +1438,30 @@ uxa_try_driver_composite(CARD8 op,
 	xSrc = xSrc + src_off_x - xDst;
 	ySrc = ySrc + src_off_y - yDst;
 
+	/* a clip of many boxes goes to the driver in batches */
 	nbox = REGION_NUM_RECTS(&region);
 	pbox = REGION_RECTS(&region);
+	n = 0;
 	while (nbox--) {
-		(*uxa_screen->info->composite) (pDstPix,
-						pbox->x1 + xSrc,
-						pbox->y1 + ySrc,
-						pbox->x1 + xMask,
-						pbox->y1 + yMask,
-						pbox->x1 + dst_off_x,
-						pbox->y1 + dst_off_y,
-						pbox->x2 - pbox->x1,
-						pbox->y2 - pbox->y1);
+		uxa_composite_rect_t *r;
+
+		if (n == UXA_COMPOSITE_BATCH) {
+			uxa_composite_emit_rects(uxa_screen, pDstPix, n, batch);
+			n = 0;
+		}
+
+		r = &batch[n++];
+		r->xSrc = pbox->x1 + xSrc;
+		r->ySrc = pbox->y1 + ySrc;
+		r->xMask = pbox->x1 + xMask;
+		r->yMask = pbox->y1 + yMask;
+		r->xDst = pbox->x1 + dst_off_x;
+		r->yDst = pbox->y1 + dst_off_y;
+		r->width = pbox->x2 - pbox->x1;
+		r->height = pbox->y2 - pbox->y1;
 		pbox++;
 	}
+	uxa_composite_emit_rects(uxa_screen, pDstPix, n, batch);
 	(*uxa_screen->info->done_composite) (pDstPix);
 
 	REGION_UNINIT(screen, &region);
@@ -1489,6 +1686,120 @@ drawable_contains (DrawablePtr drawable, int x, int y, int w, int h)
 	return TRUE;
 }
 
+/**
+ * Returns TRUE if the transform only scales, by positive factors, and
+ * translates.
+ */
+static Bool
+transform_is_scale_translation(PictTransformPtr t)
+{
+	if (t == NULL)
+		return FALSE;
+
+	return t->matrix[0][1] == 0 &&
+	       t->matrix[1][0] == 0 &&
+	       t->matrix[2][0] == 0 &&
+	       t->matrix[2][1] == 0 &&
+	       t->matrix[2][2] == IntToxFixed(1) &&
+	       t->matrix[0][0] > 0 &&
+	       t->matrix[1][1] > 0;
+}
+
+/**
+ * Maps the span [x, x + len) through one axis of a scale and translation.
+ * Returns FALSE unless both ends land on pixel boundaries, which the
+ * driver's box-to-box resampling requires.
+ */
+static Bool
+uxa_scale_span(xFixed scale, xFixed offset, int x, int len, int *x1, int *x2)
+{
+	int64_t v1 = (int64_t) scale * x + offset;
+	int64_t v2 = (int64_t) scale * (x + len) + offset;
+
+	if ((v1 & 0xffff) || (v2 & 0xffff))
+		return FALSE;
+
+	*x1 = v1 >> 16;
+	*x2 = v2 >> 16;
+	return TRUE;
+}
+
+/**
+ * Hands a composite whose source is scaled to the driver, rather than
+ * resampling it with fbComposite.
+ *
+ * @return 1 on success, -1 if the driver cannot do it.
+ */
+static int
+uxa_try_driver_composite_scaled(PicturePtr pSrc, PicturePtr pDst,
+				INT16 xSrc, INT16 ySrc,
+				INT16 xDst, INT16 yDst,
+				CARD16 width, CARD16 height)
+{
+	ScreenPtr screen = pDst->pDrawable->pScreen;
+	uxa_screen_t *uxa_screen = uxa_get_screen(screen);
+	PictTransformPtr t = pSrc->transform;
+	PixmapPtr pSrcPix, pDstPix;
+	int src_off_x, src_off_y, dst_off_x, dst_off_y;
+	BoxRec src_box, dst_box;
+	RegionRec region;
+	Bool ret;
+
+	if (pSrc->filter != PictFilterNearest &&
+	    pSrc->filter != PictFilterBilinear)
+		return -1;
+
+	/* Transforms apply in source drawable space */
+	if (!uxa_scale_span(t->matrix[0][0], t->matrix[0][2],
+			    xSrc, width, &src_box.x1, &src_box.x2) ||
+	    !uxa_scale_span(t->matrix[1][1], t->matrix[1][2],
+			    ySrc, height, &src_box.y1, &src_box.y2))
+		return -1;
+
+	/* Samples outside the source would need repeat or border handling */
+	if (!drawable_contains(pSrc->pDrawable, src_box.x1, src_box.y1,
+			       src_box.x2 - src_box.x1,
+			       src_box.y2 - src_box.y1))
+		return -1;
+
+	pSrcPix = uxa_get_offscreen_pixmap(pSrc->pDrawable, &src_off_x, &src_off_y);
+	pDstPix = uxa_get_offscreen_pixmap(pDst->pDrawable, &dst_off_x, &dst_off_y);
+	if (!pSrcPix || !pDstPix)
+		return -1;
+
+	src_off_x += pSrc->pDrawable->x;
+	src_off_y += pSrc->pDrawable->y;
+	src_box.x1 += src_off_x;
+	src_box.y1 += src_off_y;
+	src_box.x2 += src_off_x;
+	src_box.y2 += src_off_y;
+
+	xDst += pDst->pDrawable->x;
+	yDst += pDst->pDrawable->y;
+	xSrc += pSrc->pDrawable->x;
+	ySrc += pSrc->pDrawable->y;
+
+	if (!miComputeCompositeRegion(&region, pSrc, NULL, pDst,
+				      xSrc, ySrc, 0, 0, xDst, yDst,
+				      width, height))
+		return 1;
+
+	dst_box.x1 = xDst + dst_off_x;
+	dst_box.y1 = yDst + dst_off_y;
+	dst_box.x2 = dst_box.x1 + width;
+	dst_box.y2 = dst_box.y1 + height;
+	REGION_TRANSLATE(screen, &region, dst_off_x, dst_off_y);
+
+	ret = uxa_screen->info->composite_scaled(pDstPix, pSrcPix,
+						 pSrc->filter,
+						 &dst_box, &src_box,
+						 REGION_RECTS(&region),
+						 REGION_NUM_RECTS(&region));
+	REGION_UNINIT(screen, &region);
+
+	return ret ? 1 : -1;
+}
+
 void
 uxa_composite(CARD8 op,
 	      PicturePtr pSrc,
@@ -1634,6 +1945,15 @@ uxa_composite(CARD8 op,
 				if (ret)
 					goto done;
 			}
+		} else if (uxa_screen->info->composite_scaled &&
+			   compatible_formats (op, pDst, pSrc) &&
+			   transform_is_scale_translation(pSrc->transform)) {
+			ret = uxa_try_driver_composite_scaled(pSrc, pDst,
+							      xSrc, ySrc,
+							      xDst, yDst,
+							      width, height);
+			if (ret == 1)
+				goto done;
 		}
 	}
 
@@ -1693,12 +2013,41 @@ fallback:
 
 	uxa_check_composite(op, pSrc, pMask, pDst, xSrc, ySrc,
 			    xMask, yMask, xDst, yDst, width, height);
+	goto out;
 
 done:
+	UXA_STATS_ACCEL(pDst->pDrawable->pScreen, UXA_OP_COMPOSITE);
+out:
 	pSrc->repeat = saveSrcRepeat;
 	if (pMask)
 		pMask->repeat = saveMaskRepeat;
 }
+
+/**
+ * Hands a batch of prepared composite rectangles to the driver, through
+ * composite_rects() when it has one.
+ */
+void
+uxa_composite_emit_rects(uxa_screen_t *uxa_screen, PixmapPtr pDst,
+			 int nrect, uxa_composite_rect_t *rects)
+{
+	if (nrect == 0)
+		return;
+
+	if (uxa_screen->info->composite_rects) {
+		uxa_screen->info->composite_rects(pDst, nrect, rects);
+		return;
+	}
+
+	while (nrect--) {
+		uxa_screen->info->composite(pDst,
+					    rects->xSrc, rects->ySrc,
+					    rects->xMask, rects->yMask,
+					    rects->xDst, rects->yDst,
+					    rects->width, rects->height);
+		rects++;
+	}
+}
 #endif
 
 /**
@@ -1740,6 +2089,29 @@ uxa_create_alpha_picture(ScreenPtr pScreen,
 	return pPicture;
 }
 
+/**
+ * Maps the pixmap backing an alpha picture from uxa_create_alpha_picture
+ * for writing and clears it to 0 in place.
+ *
+ * Rasterizing straight into the mapping means the coverage ends up in the
+ * same storage that is later handed to the driver as the mask, instead of
+ * being produced in system memory and uploaded with a second copy.
+ * The caller must call uxa_finish_access on success.
+ */
+static Bool
+uxa_prepare_alpha_picture(PicturePtr picture)
+{
+	DrawablePtr drawable = picture->pDrawable;
+	PixmapPtr pixmap = uxa_get_drawable_pixmap(drawable);
+
+	if (!uxa_prepare_access(drawable, NULL, UXA_ACCESS_RW))
+		return FALSE;
+
+	memset(pixmap->devPrivate.ptr, 0,
+	       pixmap->devKind * pixmap->drawable.height);
+	return TRUE;
+}
+
 /**
  * uxa_trapezoids is essentially a copy of miTrapezoids that uses
  * uxa_create_alpha_picture instead of miCreateAlphaPicture.
@@ -1752,6 +2124,10 @@ uxa_create_alpha_picture(ScreenPtr pScreen,
  *
  * uxa_create_alpha_picture avoids this roundtrip by using
  * uxa_check_poly_fill_rect to initialize the contents.
+ *
+ * When the destination lives in the driver, the traps are rasterized
+ * directly into the mask pixmap, so no temporary image has to be
+ * uploaded before compositing.
  */
 void
 uxa_trapezoids(CARD8 op, PicturePtr src, PicturePtr dst,
@@ -1768,6 +2144,9 @@ uxa_trapezoids(CARD8 op, PicturePtr src, PicturePtr dst,
 
 		if (bounds.y1 >= bounds.y2 || bounds.x1 >= bounds.x2)
 			return;
+
+		/* Rasterization always happens on the CPU. */
+		UXA_STATS_FALLBACK(screen, UXA_OP_TRAPEZOIDS);
 	}
 
 	/*
@@ -1798,6 +2177,7 @@ uxa_trapezoids(CARD8 op, PicturePtr src, PicturePtr dst,
 		int width, height;
 		pixman_image_t *image;
 		pixman_format_code_t format;
+		int error;
 
 		xDst = traps[0].left.p1.x >> 16;
 		yDst = traps[0].left.p1.y >> 16;
@@ -1807,6 +2187,49 @@ uxa_trapezoids(CARD8 op, PicturePtr src, PicturePtr dst,
 
 		format = maskFormat->format |
 			(BitsPerPixel(maskFormat->depth) << 24);
+
+		xRel = bounds.x1 + xSrc - xDst;
+		yRel = bounds.y1 + ySrc - yDst;
+
+		if (uxa_drawable_is_offscreen(dst->pDrawable)) {
+			PixmapPtr pixmap;
+
+			mask = uxa_create_alpha_picture(screen, dst, maskFormat,
+							width, height);
+			if (!mask)
+				return;
+
+			if (!uxa_prepare_alpha_picture(mask)) {
+				FreePicture(mask, 0);
+				return;
+			}
+
+			pixmap = uxa_get_drawable_pixmap(mask->pDrawable);
+			image = pixman_image_create_bits(format, width, height,
+							 pixmap->devPrivate.ptr,
+							 pixmap->devKind);
+			if (!image) {
+				uxa_finish_access(mask->pDrawable);
+				FreePicture(mask, 0);
+				return;
+			}
+
+			for (; ntrap; ntrap--, traps++)
+				pixman_rasterize_trapezoid(image,
+							   (pixman_trapezoid_t *) traps,
+							   -bounds.x1, -bounds.y1);
+			pixman_image_unref(image);
+			uxa_finish_access(mask->pDrawable);
+
+			CompositePicture(op, src, mask, dst,
+					 xRel, yRel,
+					 0, 0,
+					 bounds.x1, bounds.y1,
+					 width, height);
+			FreePicture(mask, 0);
+			return;
+		}
+
 		image =
 		    pixman_image_create_bits(format, width, height, NULL, 0);
 		if (!image)
@@ -1816,22 +2239,17 @@ uxa_trapezoids(CARD8 op, PicturePtr src, PicturePtr dst,
 			pixman_rasterize_trapezoid(image,
 						   (pixman_trapezoid_t *) traps,
 						   -bounds.x1, -bounds.y1);
-		if (uxa_drawable_is_offscreen(dst->pDrawable)) {
-			mask = uxa_picture_from_pixman_image(screen, image, format);
-		} else {
-			int error;
 
-			scratch = GetScratchPixmapHeader(screen, width, height,
+		scratch = GetScratchPixmapHeader(screen, width, height,
+						 PIXMAN_FORMAT_DEPTH(format),
+						 PIXMAN_FORMAT_BPP(format),
+						 pixman_image_get_stride(image),
+						 pixman_image_get_data(image));
+		mask = CreatePicture(0, &scratch->drawable,
+				     PictureMatchFormat(screen,
 							PIXMAN_FORMAT_DEPTH(format),
-							PIXMAN_FORMAT_BPP(format),
-							pixman_image_get_stride(image),
-							pixman_image_get_data(image));
-			mask = CreatePicture(0, &scratch->drawable,
-					     PictureMatchFormat(screen,
-								PIXMAN_FORMAT_DEPTH(format),
-								format),
-					     0, 0, serverClient, &error);
-		}
+							format),
+				     0, 0, serverClient, &error);
 		if (!mask) {
 			if (scratch)
 				FreeScratchPixmapHeader(scratch);
@@ -1839,8 +2257,6 @@ uxa_trapezoids(CARD8 op, PicturePtr src, PicturePtr dst,
 			return;
 		}
 
-		xRel = bounds.x1 + xSrc - xDst;
-		yRel = bounds.y1 + ySrc - yDst;
 		CompositePicture(op, src, mask, dst,
 				 xRel, yRel,
 				 0, 0,
@@ -1872,8 +2288,8 @@ uxa_trapezoids(CARD8 op, PicturePtr src, PicturePtr dst,
  * call to AddTriangles won't be accelerated however, which forces the pixmap
  * to be moved out again.
  *
- * uxa_create_alpha_picture avoids this roundtrip by using
- * uxa_check_poly_fill_rect to initialize the contents.
+ * uxa_create_alpha_picture avoids this roundtrip by clearing the
+ * mask and rasterizing into it under a single uxa_prepare_alpha_picture.
  */
 void
 uxa_triangles(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
@@ -1890,6 +2306,8 @@ uxa_triangles(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
 
 		if (bounds.y1 >= bounds.y2 || bounds.x1 >= bounds.x2)
 			return;
+
+		UXA_STATS_FALLBACK(pScreen, UXA_OP_TRIANGLES);
 	}
 
 	/*
@@ -1907,8 +2325,6 @@ uxa_triangles(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
 		INT16 xRel, yRel;
 		int width = bounds.x2 - bounds.x1;
 		int height = bounds.y2 - bounds.y1;
-		GCPtr pGC;
-		xRectangle rect;
 
 		xDst = tris[0].p1.x >> 16;
 		yDst = tris[0].p1.y >> 16;
@@ -1918,21 +2334,8 @@ uxa_triangles(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
 		if (!pPicture)
 			return;
 
-		/* Clear the alpha picture to 0. */
-		pGC = GetScratchGC(pPicture->pDrawable->depth, pScreen);
-		if (!pGC) {
-			FreePicture(pPicture, 0);
-			return;
-		}
-		ValidateGC(pPicture->pDrawable, pGC);
-		rect.x = 0;
-		rect.y = 0;
-		rect.width = width;
-		rect.height = height;
-		uxa_check_poly_fill_rect(pPicture->pDrawable, pGC, 1, &rect);
-		FreeScratchGC(pGC);
-
-		if (uxa_prepare_access(pPicture->pDrawable, NULL, UXA_ACCESS_RW)) {
+		/* Clear and rasterize under a single mapping of the mask. */
+		if (uxa_prepare_alpha_picture(pPicture)) {
 			(*ps->AddTriangles) (pPicture, -bounds.x1, -bounds.y1,
 					     ntri, tris);
 			uxa_finish_access(pPicture->pDrawable);
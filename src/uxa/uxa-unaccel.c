@@ -1,6 +1,6 @@
 /*
  *
- * Copyright  1999 Keith Packard
+ * Copyright � 1999 Keith Packard
  *
  * Permission to use, copy, modify, distribute, and sell this software and its
  * documentation for any purpose is hereby granted without fee, provided that
@@ -26,6 +26,7 @@
 
 #ifdef RENDER
 #include "mipict.h"
+#include "fbpict.h"
 #endif
 
 /*
@@ -86,6 +87,7 @@ uxa_check_fill_spans(DrawablePtr pDrawable, GCPtr pGC, int nspans,
 
 	UXA_FALLBACK(("to %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_FILL_SPANS);
 	if (uxa_prepare_access(pDrawable, &region, UXA_ACCESS_RW)) {
 		if (uxa_prepare_access_gc(pGC)) {
 			fbFillSpans(pDrawable, pGC, nspans, ppt, pwidth,
@@ -106,6 +108,7 @@ uxa_check_set_spans(DrawablePtr pDrawable, GCPtr pGC, char *psrc,
 
 	UXA_FALLBACK(("to %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_SET_SPANS);
 	if (uxa_prepare_access(pDrawable, NULL, UXA_ACCESS_RW)) {
 		fbSetSpans(pDrawable, pGC, psrc, ppt, pwidth, nspans, fSorted);
 		uxa_finish_access(pDrawable);
@@ -121,6 +124,7 @@ uxa_check_put_image(DrawablePtr pDrawable, GCPtr pGC, int depth,
 
 	UXA_FALLBACK(("to %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_PUT_IMAGE);
 	if (uxa_prepare_access(pDrawable, NULL, UXA_ACCESS_RW)) {
 		fbPutImage(pDrawable, pGC, depth, x, y, w, h, leftPad, format,
 			   bits);
@@ -150,6 +154,7 @@ uxa_check_copy_area(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
 	UXA_FALLBACK(("from %p to %p (%c,%c)\n", pSrc, pDst,
 		      uxa_drawable_location(pSrc),
 		      uxa_drawable_location(pDst)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_COPY);
 	if (uxa_prepare_access(pDst, &dst_region, UXA_ACCESS_RW)) {
 	    if (uxa_prepare_access(pSrc, &src_region, UXA_ACCESS_RO)) {
 			ret =
@@ -177,6 +182,7 @@ uxa_check_copy_plane(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
 	UXA_FALLBACK(("from %p to %p (%c,%c)\n", pSrc, pDst,
 		      uxa_drawable_location(pSrc),
 		      uxa_drawable_location(pDst)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_COPY_PLANE);
 	if (uxa_prepare_access(pDst, NULL, UXA_ACCESS_RW)) {
 	    if (uxa_prepare_access(pSrc, NULL, UXA_ACCESS_RO)) {
 			ret =
@@ -197,6 +203,7 @@ uxa_check_poly_point(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
 
 	UXA_FALLBACK(("to %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_POLY_POINT);
 	if (uxa_prepare_access(pDrawable, NULL, UXA_ACCESS_RW)) {
 		fbPolyPoint(pDrawable, pGC, mode, npt, pptInit);
 		uxa_finish_access(pDrawable);
@@ -216,6 +223,7 @@ uxa_check_poly_lines(DrawablePtr pDrawable, GCPtr pGC,
 	UXA_FALLBACK(("to %p (%c), width %d, mode %d, count %d\n",
 		      pDrawable, uxa_drawable_location(pDrawable),
 		      pGC->lineWidth, mode, npt));
+	UXA_STATS_FALLBACK(screen, UXA_OP_POLY_LINES);
 
 	if (pGC->lineWidth == 0) {
 		if (uxa_prepare_access(pDrawable, &region, UXA_ACCESS_RW)) {
@@ -247,6 +255,7 @@ uxa_check_poly_segment(DrawablePtr pDrawable, GCPtr pGC,
 	UXA_FALLBACK(("to %p (%c) width %d, count %d\n", pDrawable,
 		      uxa_drawable_location(pDrawable), pGC->lineWidth,
 		      nsegInit));
+	UXA_STATS_FALLBACK(screen, UXA_OP_POLY_SEGMENT);
 	if (pGC->lineWidth == 0) {
 	    if (uxa_prepare_access(pDrawable, &region, UXA_ACCESS_RW)) {
 			if (uxa_prepare_access_gc(pGC)) {
@@ -273,6 +282,7 @@ uxa_check_poly_arc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc * pArcs)
 
 	UXA_FALLBACK(("to %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_POLY_ARC);
 
 	/* Disable this as fbPolyArc can call miZeroPolyArc which in turn
 	 * can call accelerated functions, that as yet, haven't been notified
@@ -293,6 +303,80 @@ uxa_check_poly_arc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc * pArcs)
 	miPolyArc(pDrawable, pGC, narcs, pArcs);
 }
 
+typedef struct {
+	FbBits *bits;
+	FbStride stride;
+	int bpp;
+	int xoff, yoff;
+	FbBits xor;
+	BoxPtr boxes;
+	int nbox;
+} uxa_fill_bands_t;
+
+static void
+uxa_fill_band(void *closure, int y1, int y2)
+{
+	uxa_fill_bands_t *fill = closure;
+	BoxPtr box = fill->boxes;
+	int n;
+
+	for (n = fill->nbox; n--; box++) {
+		int by1 = max(box->y1, y1);
+		int by2 = min(box->y2, y2);
+
+		if (by1 >= by2)
+			continue;
+
+		pixman_fill((uint32_t *) fill->bits, fill->stride, fill->bpp,
+			    box->x1 + fill->xoff, by1 + fill->yoff,
+			    box->x2 - box->x1, by2 - by1, fill->xor);
+	}
+}
+
+/**
+ * Splits a large solid fill over the parallel fallback executor.
+ * Must be called with access to the drawable prepared.
+ */
+static Bool
+uxa_parallel_poly_fill_rect(DrawablePtr pDrawable, GCPtr pGC,
+			    int nrect, xRectangle * prect)
+{
+	ScreenPtr screen = pDrawable->pScreen;
+	RegionPtr clip = fbGetCompositeClip(pGC);
+	uxa_fill_bands_t fill;
+	RegionPtr region;
+	Bool ret;
+
+	if (pGC->fillStyle != FillSolid || pGC->alu != GXcopy ||
+	    !UXA_PM_IS_SOLID(pDrawable, pGC->planemask) ||
+	    pDrawable->bitsPerPixel < 8)
+		return FALSE;
+
+	/* don't bother building the region for small fills */
+	if ((int64_t) (clip->extents.x2 - clip->extents.x1) *
+	    (clip->extents.y2 - clip->extents.y1) < UXA_PARALLEL_MIN_PIXELS)
+		return FALSE;
+
+	region = RECTS_TO_REGION(screen, nrect, prect, CT_UNSORTED);
+	if (!region)
+		return FALSE;
+	REGION_TRANSLATE(screen, region, pDrawable->x, pDrawable->y);
+	REGION_INTERSECT(screen, region, region, clip);
+
+	fbGetDrawable(pDrawable, fill.bits, fill.stride, fill.bpp,
+		      fill.xoff, fill.yoff);
+	fill.xor = fbGetGCPrivate(pGC)->xor;
+	fill.boxes = REGION_RECTS(region);
+	fill.nbox = REGION_NUM_RECTS(region);
+
+	ret = uxa_parallel_run(screen, region->extents.y1, region->extents.y2,
+			       region->extents.x2 - region->extents.x1,
+			       uxa_fill_band, &fill);
+
+	REGION_DESTROY(screen, region);
+	return ret;
+}
+
 void
 uxa_check_poly_fill_rect(DrawablePtr pDrawable, GCPtr pGC,
 			 int nrect, xRectangle * prect)
@@ -305,10 +389,13 @@ uxa_check_poly_fill_rect(DrawablePtr pDrawable, GCPtr pGC,
 	
 	UXA_FALLBACK(("to %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_POLY_FILL_RECT);
 
 	if (uxa_prepare_access(pDrawable, &region, UXA_ACCESS_RW)) {
 		if (uxa_prepare_access_gc(pGC)) {
-			fbPolyFillRect(pDrawable, pGC, nrect, prect);
+			if (!uxa_parallel_poly_fill_rect(pDrawable, pGC,
+							 nrect, prect))
+				fbPolyFillRect(pDrawable, pGC, nrect, prect);
 			uxa_finish_access_gc(pGC);
 		}
 		uxa_finish_access(pDrawable);
@@ -330,6 +417,7 @@ uxa_check_image_glyph_blt(DrawablePtr pDrawable, GCPtr pGC,
 
 	UXA_FALLBACK(("to %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_IMAGE_GLYPH_BLT);
 	if (uxa_prepare_access(pDrawable, &region, UXA_ACCESS_RW)) {
 		if (uxa_prepare_access_gc(pGC)) {
 			fbImageGlyphBlt(pDrawable, pGC, x, y, nglyph, ppci,
@@ -356,6 +444,7 @@ uxa_check_poly_glyph_blt(DrawablePtr pDrawable, GCPtr pGC,
 	UXA_FALLBACK(("to %p (%c), style %d alu %d\n", pDrawable,
 		      uxa_drawable_location(pDrawable), pGC->fillStyle,
 		      pGC->alu));
+	UXA_STATS_FALLBACK(screen, UXA_OP_POLY_GLYPH_BLT);
 	if (uxa_prepare_access(pDrawable, &region, UXA_ACCESS_RW)) {
 		if (uxa_prepare_access_gc(pGC)) {
 			fbPolyGlyphBlt(pDrawable, pGC, x, y, nglyph, ppci,
@@ -381,6 +470,7 @@ uxa_check_push_pixels(GCPtr pGC, PixmapPtr pBitmap,
 	UXA_FALLBACK(("from %p to %p (%c,%c)\n", pBitmap, pDrawable,
 		      uxa_drawable_location(&pBitmap->drawable),
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_PUSH_PIXELS);
 	if (uxa_prepare_access(pDrawable, &region, UXA_ACCESS_RW)) {
 	    if (uxa_prepare_access(&pBitmap->drawable, NULL, UXA_ACCESS_RO)) {
 			if (uxa_prepare_access_gc(pGC)) {
@@ -405,12 +495,100 @@ uxa_check_get_spans(DrawablePtr pDrawable,
 
 	UXA_FALLBACK(("from %p (%c)\n", pDrawable,
 		      uxa_drawable_location(pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_GET_SPANS);
 	if (uxa_prepare_access(pDrawable, NULL, UXA_ACCESS_RO)) {
 		fbGetSpans(pDrawable, wMax, ppt, pwidth, nspans, pdstStart);
 		uxa_finish_access(pDrawable);
 	}
 }
 
+typedef struct {
+	CARD8 op;
+	pixman_image_t *src, *mask, *dst;
+	int xSrc, ySrc;
+	int xMask, yMask;
+	int xDst, yDst;
+	int width;
+} uxa_composite_bands_t;
+
+static void
+uxa_composite_band(void *closure, int y1, int y2)
+{
+	uxa_composite_bands_t *c = closure;
+	int dy = y1 - c->yDst;
+
+	pixman_image_composite(c->op, c->src, c->mask, c->dst,
+			       c->xSrc, c->ySrc + dy,
+			       c->xMask, c->yMask + dy,
+			       c->xDst, y1, c->width, y2 - y1);
+}
+
+/**
+ * Does what fbComposite() does, with the pixman work split over the
+ * parallel fallback executor.  Must be called with access prepared.
+ */
+static Bool
+uxa_parallel_composite(CARD8 op,
+		       PicturePtr pSrc,
+		       PicturePtr pMask,
+		       PicturePtr pDst,
+		       INT16 xSrc, INT16 ySrc,
+		       INT16 xMask, INT16 yMask,
+		       INT16 xDst, INT16 yDst,
+		       CARD16 width, CARD16 height)
+{
+	uxa_composite_bands_t c;
+	int src_xoff, src_yoff;
+	int msk_xoff = 0, msk_yoff = 0;
+	int dst_xoff, dst_yoff;
+	PixmapPtr dst_pixmap;
+	Bool ret = FALSE;
+
+	if ((int64_t) width * height < UXA_PARALLEL_MIN_PIXELS)
+		return FALSE;
+
+	/* Bands read rows another worker may be writing; stay serial. */
+	dst_pixmap = uxa_get_drawable_pixmap(pDst->pDrawable);
+	if (pSrc->pDrawable &&
+	    uxa_get_drawable_pixmap(pSrc->pDrawable) == dst_pixmap)
+		return FALSE;
+	if (pMask && pMask->pDrawable &&
+	    uxa_get_drawable_pixmap(pMask->pDrawable) == dst_pixmap)
+		return FALSE;
+
+	miCompositeSourceValidate(pSrc);
+	if (pMask)
+		miCompositeSourceValidate(pMask);
+
+	c.src = image_from_pict(pSrc, FALSE, &src_xoff, &src_yoff);
+	c.mask = image_from_pict(pMask, FALSE, &msk_xoff, &msk_yoff);
+	c.dst = image_from_pict(pDst, TRUE, &dst_xoff, &dst_yoff);
+
+	if (c.src && c.dst && !(pMask && !c.mask)) {
+		c.op = op;
+		c.xSrc = xSrc + src_xoff;
+		c.ySrc = ySrc + src_yoff;
+		c.xMask = xMask + msk_xoff;
+		c.yMask = yMask + msk_yoff;
+		c.xDst = xDst + dst_xoff;
+		c.yDst = yDst + dst_yoff;
+		c.width = width;
+
+		ret = uxa_parallel_run(pDst->pDrawable->pScreen,
+				       c.yDst, c.yDst + height, width,
+				       uxa_composite_band, &c);
+	}
+
+	if (c.src)
+		free_pixman_pict(pSrc, c.src);
+	if (c.mask)
+		free_pixman_pict(pMask, c.mask);
+	if (c.dst)
+		free_pixman_pict(pDst, c.dst);
+
+	return ret;
+}
+
 void
 uxa_check_composite(CARD8 op,
 		    PicturePtr pSrc,
@@ -425,6 +603,7 @@ uxa_check_composite(CARD8 op,
 	RegionRec region;
 
 	UXA_FALLBACK(("from picts %p/%p to pict %p\n", pSrc, pMask, pDst));
+	UXA_STATS_FALLBACK(screen, UXA_OP_COMPOSITE);
 
 	REGION_INIT (screen, &region, (BoxPtr)NULL, 0);
 	uxa_damage_composite (&region, op, pSrc, pMask, pDst,
@@ -442,11 +621,16 @@ uxa_check_composite(CARD8 op,
 			if (!pMask || pMask->pDrawable == NULL ||
 			    uxa_prepare_access(pMask->pDrawable, NULL, UXA_ACCESS_RO))
 			{
-				fbComposite(op, pSrc, pMask, pDst,
-					    xSrc, ySrc,
-					    xMask, yMask,
-					    xDst, yDst,
-					    width, height);
+				if (!uxa_parallel_composite(op, pSrc, pMask, pDst,
+							    xSrc, ySrc,
+							    xMask, yMask,
+							    xDst, yDst,
+							    width, height))
+					fbComposite(op, pSrc, pMask, pDst,
+						    xSrc, ySrc,
+						    xMask, yMask,
+						    xDst, yDst,
+						    width, height);
 				if (pMask && pMask->pDrawable != NULL)
 					uxa_finish_access(pMask->pDrawable);
 			}
@@ -465,6 +649,7 @@ uxa_check_add_traps(PicturePtr pPicture,
 
 	UXA_FALLBACK(("to pict %p (%c)\n", pPicture,
 		      uxa_drawable_location(pPicture->pDrawable)));
+	UXA_STATS_FALLBACK(screen, UXA_OP_ADD_TRAPS);
 	if (uxa_prepare_access(pPicture->pDrawable, NULL, UXA_ACCESS_RW)) {
 		fbAddTraps(pPicture, x_off, y_off, ntrap, traps);
 		uxa_finish_access(pPicture->pDrawable);
@@ -396,6 +396,44 @@ Bool uxa_swapped_out(ScreenPtr screen)
 	return uxa_screen->swappedOut;
 }
 
+uxa_stats_t *uxa_get_stats(ScreenPtr screen)
+{
+	uxa_screen_t *uxa_screen = uxa_get_screen(screen);
+
+	return &uxa_screen->stats;
+}
+
+static const char *uxa_op_names[UXA_NUM_OPS] = {
+	[UXA_OP_FILL_SPANS] = "FillSpans",
+	[UXA_OP_SET_SPANS] = "SetSpans",
+	[UXA_OP_PUT_IMAGE] = "PutImage",
+	[UXA_OP_COPY] = "CopyArea",
+	[UXA_OP_COPY_PLANE] = "CopyPlane",
+	[UXA_OP_POLY_POINT] = "PolyPoint",
+	[UXA_OP_POLY_LINES] = "PolyLines",
+	[UXA_OP_POLY_SEGMENT] = "PolySegment",
+	[UXA_OP_POLY_ARC] = "PolyArc",
+	[UXA_OP_POLY_FILL_RECT] = "PolyFillRect",
+	[UXA_OP_IMAGE_GLYPH_BLT] = "ImageGlyphBlt",
+	[UXA_OP_POLY_GLYPH_BLT] = "PolyGlyphBlt",
+	[UXA_OP_PUSH_PIXELS] = "PushPixels",
+	[UXA_OP_GET_IMAGE] = "GetImage",
+	[UXA_OP_GET_SPANS] = "GetSpans",
+	[UXA_OP_COMPOSITE] = "Composite",
+	[UXA_OP_SOLID_RECTS] = "CompositeRects",
+	[UXA_OP_GLYPHS] = "Glyphs",
+	[UXA_OP_TRAPEZOIDS] = "Trapezoids",
+	[UXA_OP_TRIANGLES] = "Triangles",
+	[UXA_OP_ADD_TRAPS] = "AddTraps",
+};
+
+const char *uxa_op_name(uxa_op_t op)
+{
+	if (op >= UXA_NUM_OPS)
+		return "unknown";
+	return uxa_op_names[op];
+}
+
 /**
  * uxa_close_screen() unwraps its wrapped screen functions and tears down UXA's
  * screen private, before calling down to the next CloseSccreen.
@@ -417,8 +455,13 @@ static Bool uxa_close_screen(CLOSE_SCREEN_ARGS_DECL)
 		FreePicture(uxa_screen->solid_white, 0);
 	for (n = 0; n < uxa_screen->solid_cache_size; n++)
 		FreePicture(uxa_screen->solid_cache[n].picture, 0);
+	for (n = 0; n < uxa_screen->gradient_cache_size; n++) {
+		FreePicture(uxa_screen->gradient_cache[n].picture, 0);
+		free(uxa_screen->gradient_cache[n].key);
+	}
 
 	uxa_glyphs_fini(pScreen);
+	uxa_parallel_fini(pScreen);
 
 	pScreen->CreateGC = uxa_screen->SavedCreateGC;
 	pScreen->CloseScreen = uxa_screen->SavedCloseScreen;
@@ -529,6 +572,7 @@ Bool uxa_driver_init(ScreenPtr screen, uxa_driver_t * uxa_driver)
 	uxa_screen->solid_clear = 0;
 	uxa_screen->solid_black = 0;
 	uxa_screen->solid_white = 0;
+	uxa_screen->gradient_cache_size = 0;
 
 //    exaDDXDriverInit(screen);
 
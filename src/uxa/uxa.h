@@ -48,6 +48,22 @@ typedef enum {
 	UXA_ACCESS_RW
 } uxa_access_t;
 
+/**
+ * One rectangle of a batched composite operation, as passed to
+ * composite_rects().  Coordinates are in the same spaces as the arguments
+ * to composite().
+ */
+typedef struct {
+	INT16 xSrc;
+	INT16 ySrc;
+	INT16 xMask;
+	INT16 yMask;
+	INT16 xDst;
+	INT16 yDst;
+	INT16 width;
+	INT16 height;
+} uxa_composite_rect_t;
+
 /**
  * The UxaDriver structure is allocated through uxa_driver_alloc(), and then
  * fllled in by drivers.
@@ -402,8 +418,55 @@ typedef struct _UxaDriver {
 	 * This call is required if prepare_composite() ever succeeds.
 	 */
 	void (*done_composite) (PixmapPtr pDst);
+
+	/**
+	 * composite_rects() performs a batch of composite() operations.
+	 *
+	 * @param pDst destination pixmap
+	 * @param nrect number of rectangles
+	 * @param rects the rectangles, already clipped to the destination
+	 *
+	 * It is called between prepare_composite() and done_composite(),
+	 * in place of one composite() call per rectangle, so that drivers
+	 * can emit the whole batch with a single draw.  UXA may call it
+	 * several times within one prepare/done pair.
+	 *
+	 * composite_rects() is optional; without it UXA calls composite()
+	 * for each rectangle.
+	 */
+	void (*composite_rects) (PixmapPtr pDst,
+				 int nrect, uxa_composite_rect_t *rects);
 	/** @} */
 
+	/**
+	 * composite_scaled() resamples a box of the source pixmap into a box
+	 * of the destination pixmap.
+	 *
+	 * @param pDst destination pixmap
+	 * @param pSrc source pixmap
+	 * @param filter PictFilterNearest or PictFilterBilinear
+	 * @param dst_box destination box the source box is stretched onto
+	 * @param src_box source box, in source pixmap coordinates
+	 * @param clip boxes within dst_box that are to be written
+	 * @param nclip number of clip boxes
+	 *
+	 * This is used for PictOpSrc composites, and PictOpOver composites
+	 * with an opaque source, whose source transform is a scale and
+	 * translation.  The scale is implied by the ratio of the box sizes;
+	 * pixel centers map linearly from one box to the other.
+	 *
+	 * @return FALSE if the driver cannot perform the operation, in which
+	 * case UXA falls back to software.
+	 *
+	 * composite_scaled() is optional.
+	 */
+	Bool(*composite_scaled) (PixmapPtr pDst,
+				 PixmapPtr pSrc,
+				 int filter,
+				 BoxPtr dst_box,
+				 BoxPtr src_box,
+				 BoxPtr clip, int nclip);
+
 	/**
 	 * put_image() loads a rectangle of data from src into pDst.
 	 *
@@ -574,6 +637,46 @@ void uxa_set_fallback_debug(ScreenPtr screen, Bool enable);
 void uxa_set_force_fallback(ScreenPtr screen, Bool enable);
 Bool uxa_swapped_out (ScreenPtr screen);
 
+/**
+ * Operations for which UXA keeps accelerated/fallback call counts.
+ */
+typedef enum {
+	UXA_OP_FILL_SPANS,
+	UXA_OP_SET_SPANS,
+	UXA_OP_PUT_IMAGE,
+	UXA_OP_COPY,
+	UXA_OP_COPY_PLANE,
+	UXA_OP_POLY_POINT,
+	UXA_OP_POLY_LINES,
+	UXA_OP_POLY_SEGMENT,
+	UXA_OP_POLY_ARC,
+	UXA_OP_POLY_FILL_RECT,
+	UXA_OP_IMAGE_GLYPH_BLT,
+	UXA_OP_POLY_GLYPH_BLT,
+	UXA_OP_PUSH_PIXELS,
+	UXA_OP_GET_IMAGE,
+	UXA_OP_GET_SPANS,
+	UXA_OP_COMPOSITE,
+	UXA_OP_SOLID_RECTS,
+	UXA_OP_GLYPHS,
+	UXA_OP_TRAPEZOIDS,
+	UXA_OP_TRIANGLES,
+	UXA_OP_ADD_TRAPS,
+	UXA_NUM_OPS
+} uxa_op_t;
+
+typedef struct {
+	unsigned long accel[UXA_NUM_OPS];
+	unsigned long fallback[UXA_NUM_OPS];
+} uxa_stats_t;
+
+/**
+ * Returns the live statistics for the screen.  The driver may read or
+ * clear them at any time; UXA only ever increments the counters.
+ */
+uxa_stats_t *uxa_get_stats(ScreenPtr screen);
+const char *uxa_op_name(uxa_op_t op);
+
 /**
  * Returns TRUE if the given planemask covers all the significant bits in the
  * pixel values for pDrawable.
@@ -77,9 +77,24 @@ struct virgl_surface_t
 
     struct virgl_bo *bo;
 
+    /* on virgl->surface_lru while the bo may be evicted */
+    struct xorg_list lru;
+    int dri2_refs;		/* DRI2 buffers and DRI3 exports naming the bo */
+
+    uint32_t fb_id;		/* for Present flips, see virgl_present.c */
+
+    /* contents not yet in the bo, see virgl_kms_migrate_region */
+    pixman_image_t *migrate_image;
+    RegionRec migrate_pending;
+    struct xorg_list migrate_link;
+
     union
     {
 	struct virgl_surface_t *copy_src;
+	struct {
+	    struct virgl_bo *bo;
+	    int x;
+	} solid;
     } u;
 
 };
@@ -91,6 +106,10 @@ typedef struct virgl_surface_t virgl_surface_t;
  */
 
 enum {
+    OPTION_SIMULATE_DEVICE = 0,
+    OPTION_SIMULATE_LATENCY,
+    OPTION_SUBMIT_THREAD,
+    OPTION_VIDEO_MEMORY_BUDGET,
     OPTION_COUNT,
 };
 
@@ -113,13 +132,114 @@ struct virgl_bo_funcs {
 void virgl_kms_setup_funcs(virgl_screen_t *virgl);
 
 #define MAX_RELOCS 96
+#define VIRGL_SOLID_SLAB_SIZE 256
+#define VIRGL_SOLID_SLAB_DEPTHS 3	/* 8, 16 and 32 bpp */
+#define VIRGL_STAGING_SLOTS 4
+#define VIRGL_STAGING_WIDTH 2048
+#define VIRGL_STAGING_HEIGHT 256
+#define VIRGL_READBACK_BAND 128
+#define VIRGL_READBACK_DEPTH 2
+#define VIRGL_MIGRATE_STEP (4 << 20)	/* bytes per block handler */
 #include "drm/virtgpu_drm.h"
 
+/*
+ * Rows of a resource's guest backing start on a cache line when the
+ * transfer ioctls can pass the stride; otherwise the host assumes them
+ * tightly packed.
+ */
+#ifdef HAVE_STRUCT_DRM_VIRTGPU_3D_TRANSFER_TO_HOST_STRIDE
+#define VIRGL_STRIDE_ALIGN 64
+#else
+#define VIRGL_STRIDE_ALIGN 1
+#endif
+
+static inline int virgl_stride (int width, int cpp)
+{
+    return (width * cpp + VIRGL_STRIDE_ALIGN - 1) & ~(VIRGL_STRIDE_ALIGN - 1);
+}
+
 struct virgl_cmd_stream {
   struct virgl_bo *reloc_bo[MAX_RELOCS];
   int n_reloc_bos;
 };
 
+/*
+ * Statistics
+ */
+
+enum virgl_stat_ioctl {
+    VIRGL_STAT_RESOURCE_CREATE,
+    VIRGL_STAT_MAP,
+    VIRGL_STAT_TRANSFER_TO_HOST,
+    VIRGL_STAT_TRANSFER_FROM_HOST,
+    VIRGL_STAT_EXECBUFFER,
+    VIRGL_STAT_WAIT,
+    VIRGL_STAT_GEM_CLOSE,
+    VIRGL_STAT_DIRTYFB,
+    VIRGL_STAT_OTHER,
+    VIRGL_STAT_NUM_IOCTLS
+};
+
+/* bucket n counts samples in [2^(n-1), 2^n), the last one everything above */
+#define VIRGL_STAT_HIST_BUCKETS 16
+
+struct virgl_ioctl_stats {
+    uint64_t count;
+    uint64_t usecs;
+    uint64_t max_usecs;
+    uint32_t hist[VIRGL_STAT_HIST_BUCKETS];	/* microseconds */
+};
+
+struct virgl_transfer_stats {
+    uint64_t count;
+    uint64_t bytes;
+    uint32_t hist[VIRGL_STAT_HIST_BUCKETS];	/* kilobytes */
+};
+
+struct virgl_stats {
+    struct virgl_ioctl_stats ioctl[VIRGL_STAT_NUM_IOCTLS];
+    struct virgl_transfer_stats upload;
+    struct virgl_transfer_stats readback;
+    uint64_t evictions;
+    Atom property;
+};
+
+/*
+ * One slot of the upload ring.  Rows are handed out from the top of the
+ * slot until it is full; then the next slot is used, waiting for its
+ * previous transfers only if the host hasn't caught up yet.
+ */
+struct virgl_staging_slot {
+    struct virgl_bo *bo;
+    uint32_t format;
+    int used;			/* rows handed out */
+    Bool queued;		/* copies from it not yet flushed */
+};
+
+/*
+ * Banded readback through the staging ring: while the caller consumes
+ * one band, the host is already copying out the next.
+ */
+struct virgl_readback {
+    virgl_surface_t *surf;
+    BoxRec box;
+    int x, y;			/* next band to issue */
+    Bool failed;
+    int n_inflight;
+    struct {
+	BoxRec box;
+	int slot;
+	int row;
+    } inflight[VIRGL_READBACK_DEPTH];
+};
+
+/* scratch memory that is valid until the next block handler */
+struct virgl_arena_chunk;
+
+struct virgl_arena {
+    struct virgl_arena_chunk *chunks;
+};
+
 struct graw_encoder_state {
    uint32_t *buf;
    uint32_t buf_total;
@@ -130,7 +250,6 @@ struct graw_encoder_state {
 
    void (*flush)(struct graw_encoder_state *state, void *closure);
    void *closure;
-   int fd;
 };
 
 struct _virgl_screen_t
@@ -174,10 +293,13 @@ struct _virgl_screen_t
     ScrnInfoPtr			pScrn;
 
     struct xorg_list ums_bos;
+    struct xorg_list kms_bos;	/* every live virgl_kms_bo */
     struct virgl_bo_funcs *bo_funcs;
 
     Bool kms_enabled;
 
+    OptionInfoPtr		options;
+
     drmmode_rec drmmode;
     int drm_fd;
     char *drm_device_name;
@@ -190,6 +312,51 @@ struct _virgl_screen_t
     struct graw_encoder_state *gr_enc;
 
     Bool has_3d_accel;
+
+    /* host-visible blob resources, see virgl_bo_alloc_blob */
+    Bool has_blob;
+    uint32_t next_blob_id;
+    Bool blob_pending;		/* commands submitted since the last sync */
+
+    /* scratch resource for overlapping self-copies */
+    struct virgl_bo *copy_scratch;
+    uint32_t copy_scratch_format;
+    int copy_scratch_width;
+    int copy_scratch_height;
+
+    /* recently used fill colours, one texel each in a row resource
+     * per depth */
+    struct {
+	struct virgl_bo *bo;
+	int count;
+	Pixel pixel[VIRGL_SOLID_SLAB_SIZE];
+    } solid_slab[VIRGL_SOLID_SLAB_DEPTHS];
+
+    /* staging resources for uploads, see virgl_kms_upload */
+    struct virgl_staging_slot staging[VIRGL_STAGING_SLOTS];
+    int staging_cur;
+
+    struct virgl_stats stats;
+
+    /* per-request temporaries, reset in the block handler */
+    struct virgl_arena scratch;
+
+    /* simulated device, see virgl_sim.c */
+    struct virgl_sim *sim;
+
+    /* submission thread, see virgl_submit.c */
+    struct virgl_submit *submit;
+
+    /* host memory held by resources, see virgl_kms_enforce_budget */
+    uint64_t bo_bytes;
+    uint64_t bo_budget;		/* 0 for no limit */
+    struct xorg_list surface_lru;	/* least recently used first */
+
+    /* surfaces still being migrated */
+    struct xorg_list migrating;
+
+    /* pending Present vblank timers, see virgl_present.c */
+    struct xorg_list present_vblanks;
 };
 
 void		    virgl_surface_set_pixmap (virgl_surface_t *surface,
@@ -213,6 +380,16 @@ static inline virgl_surface_t *get_surface (PixmapPtr pixmap)
 #endif
 }
 
+/* move an evictable surface to the most recently used end */
+static inline void virgl_surface_touch (virgl_surface_t *surface)
+{
+    if (!xorg_list_is_empty (&surface->lru))
+    {
+	xorg_list_del (&surface->lru);
+	xorg_list_append (&surface->lru, &surface->virgl->surface_lru);
+    }
+}
+
 static inline void set_surface (PixmapPtr pixmap, virgl_surface_t *surface)
 {
     dixSetPrivate(&pixmap->devPrivates, &uxa_pixmap_index, surface);
@@ -231,15 +408,39 @@ Bool virgl_kms_check_cap(virgl_screen_t *virgl, int cap);
 uint32_t virgl_kms_bo_get_handle(struct virgl_bo *_bo);
 uint32_t virgl_kms_bo_get_res_handle(struct virgl_bo *_bo);
 int virgl_kms_get_kernel_name(struct virgl_bo *_bo, uint32_t *name);
+virgl_surface_t *virgl_kms_surface_from_fd(virgl_screen_t *virgl, int fd,
+					   int width, int height, int depth,
+					   int stride);
+int virgl_kms_bo_export_fd(struct virgl_bo *_bo, int *fd, uint32_t *size);
 
 int virgl_kms_3d_resource_migrate(struct virgl_surface_t *surf);
+void virgl_kms_migrate_region(struct virgl_surface_t *surf, RegionPtr need);
+void virgl_kms_migrate_box(struct virgl_surface_t *surf, BoxPtr box);
+void virgl_kms_migrate_discard(struct virgl_surface_t *surf, BoxPtr box);
 void virgl_kms_transfer_block(struct virgl_surface_t *surf,
 			    int x1, int y1, int x2, int y2);
+Bool virgl_kms_upload(struct virgl_surface_t *surf, int x, int y, int w, int h,
+		      const char *src, int src_pitch);
+void virgl_kms_staging_fini(virgl_screen_t *virgl);
+void virgl_kms_readback_begin(struct virgl_readback *rb,
+			      struct virgl_surface_t *surf,
+			      int x1, int y1, int x2, int y2);
+Bool virgl_kms_readback_next(struct virgl_readback *rb, BoxPtr band,
+			     const char **data, int *pitch);
+void virgl_kms_transfer_get_boxes(struct virgl_surface_t *surf,
+				  const BoxRec *boxes, int n_boxes);
 void virgl_kms_transfer_get_block(struct virgl_surface_t *surf,
 				int x1, int y1, int x2, int y2);
 struct virgl_bo *virgl_bo_create_primary_resource(virgl_screen_t *virgl, uint32_t width, uint32_t height, int32_t stride, uint32_t format, int flags);
-int virgl_execbuffer(int fd, uint32_t *block, int ndw);
-struct graw_encoder_state *graw_encoder_init_queue(int fd);
+struct virgl_bo *virgl_bo_create_solid_slab(virgl_screen_t *virgl, int bpp);
+void virgl_bo_write_solid(virgl_screen_t *virgl, struct virgl_bo *bo, int bpp,
+			  int x, Pixel pixel, Bool reused);
+int virgl_ioctl(virgl_screen_t *virgl, unsigned long request, void *arg);
+int virgl_do_ioctl(virgl_screen_t *virgl, unsigned long request, void *arg);
+int virgl_issue_ioctl(virgl_screen_t *virgl, unsigned long request, void *arg,
+		      struct virgl_ioctl_stats *stats);
+int virgl_execbuffer(virgl_screen_t *virgl, uint32_t *block, int ndw);
+struct graw_encoder_state *graw_encoder_init_queue(virgl_screen_t *virgl);
 int graw_encode_resource_copy_region(struct graw_encoder_state *enc,
                                      uint32_t dst_res_handle,
                                      unsigned dst_level,
@@ -247,10 +448,17 @@ int graw_encode_resource_copy_region(struct graw_encoder_state *enc,
                                      uint32_t src_res_handle,
                                      unsigned src_level,
                                      const struct drm_virtgpu_3d_box *src_box);
+
+/* blit filters and flags, as in the first dword of a blit command */
+#define GRAW_BLIT_FILTER_NEAREST	0
+#define GRAW_BLIT_FILTER_LINEAR		1
+#define GRAW_BLIT_SCISSOR_ENABLE	(1 << 10)
+
 int graw_encode_blit(struct graw_encoder_state *enc,
                      uint32_t dst_handle, uint32_t src_handle,
 		     struct drm_virtgpu_3d_box *dbox,
-		     struct drm_virtgpu_3d_box *sbox);
+		     struct drm_virtgpu_3d_box *sbox,
+		     unsigned filter, const BoxRec *scissor);
 
 #ifdef WITH_CHECK_POINT
 #define CHECK_POINT() ErrorF ("%s: %d  (%s)\n", __FILE__, __LINE__, __FUNCTION__);
@@ -260,16 +468,61 @@ int graw_encode_blit(struct graw_encoder_state *enc,
 
 Bool virgl_dri2_init(ScreenPtr pScreen);
 void virgl_dri2_fini(ScreenPtr pScreen);
+Bool virgl_dri3_init(ScreenPtr pScreen);
+Bool virgl_present_init(ScreenPtr pScreen);
+void virgl_present_fini(ScreenPtr pScreen);
 
 void *              virgl_surface_get_host_bits(virgl_surface_t *surface);
 
 virgl_surface_t *virgl_create_primary (virgl_screen_t *virgl, int bpp);
 void virgl_get_formats (int bpp, pixman_format_code_t *pformat, uint32_t *virgl_format);
 void virgl_flush(virgl_screen_t *virgl);
+void virgl_flush_sync(virgl_screen_t *virgl);
+
+/* statistics */
+uint64_t virgl_stats_now(void);
+void virgl_stats_ioctl(virgl_screen_t *virgl, enum virgl_stat_ioctl which,
+		       uint64_t start);
+void virgl_stats_record(struct virgl_ioctl_stats *st, uint64_t start);
+void virgl_stats_merge(virgl_screen_t *virgl, struct virgl_ioctl_stats *from);
+void virgl_stats_transfer(virgl_screen_t *virgl, Bool readback, uint32_t bytes);
+void virgl_stats_init(ScreenPtr pScreen);
+void virgl_stats_check(ScreenPtr pScreen);
+void virgl_stats_dump(ScreenPtr pScreen);
+const char *virgl_stats_ioctl_name(enum virgl_stat_ioctl which);
+
+/* scratch arena */
+void *virgl_arena_alloc(struct virgl_arena *arena, size_t size);
+void virgl_arena_reset(struct virgl_arena *arena);
+void virgl_arena_fini(struct virgl_arena *arena);
+
+/* copy and conversion kernels */
+void virgl_copy_rows(uint8_t *dst, int dst_pitch,
+		     const uint8_t *src, int src_pitch, int width, int height);
+void virgl_convert_image(pixman_image_t *dst, pixman_image_t *src,
+			 int x, int y, int width, int height, Bool stream);
+
+/* submission thread */
+Bool virgl_submit_init(virgl_screen_t *virgl);
+void virgl_submit_fini(virgl_screen_t *virgl);
+void virgl_submit_sync(virgl_screen_t *virgl);
+Bool virgl_submit_ioctl(virgl_screen_t *virgl, unsigned long request,
+			void *arg);
+Bool virgl_submit_dirty_fb(virgl_screen_t *virgl, uint32_t fb_id,
+			   drmModeClip *clips, int num_clips);
+
+/* simulated device */
+Bool virgl_sim_init(virgl_screen_t *virgl, const char *latency);
+void virgl_sim_fini(virgl_screen_t *virgl);
+int virgl_sim_ioctl(virgl_screen_t *virgl, enum virgl_stat_ioctl which,
+		    unsigned long request, void *arg);
 #define VIRGL_CREATE_PIXMAP_DRI2 0x10000000
 
 struct virgl_bo *virgl_bo_create_argb_cursor_resource(virgl_screen_t *virgl,
 							  uint32_t width, uint32_t height);
+void virgl_bo_write_cursor(virgl_screen_t *virgl, struct virgl_bo *bo,
+			   const uint32_t *image, uint32_t width,
+			   uint32_t height, Bool reused);
 
 /* formats */
 #define VIRGL_FORMAT_B8G8R8A8_UNORM 1
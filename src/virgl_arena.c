@@ -0,0 +1,136 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Per-screen scratch arena.
+ *
+ * Temporary arrays that only live until the next time the server goes
+ * idle are bump allocated from here instead of going through malloc on
+ * every request.  The block handler resets the arena; if a busy frame
+ * needed more than one chunk they are merged into a single chunk big
+ * enough for the whole frame, so the steady state is one chunk and no
+ * allocations at all.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "virgl.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_CHUNK 4096
+
+struct virgl_arena_chunk {
+    struct virgl_arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+static struct virgl_arena_chunk *
+arena_new_chunk (size_t size)
+{
+    struct virgl_arena_chunk *chunk;
+
+    if (size < ARENA_MIN_CHUNK)
+	size = ARENA_MIN_CHUNK;
+
+    chunk = malloc (sizeof (*chunk) + size);
+    if (!chunk)
+	return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void *
+virgl_arena_alloc (struct virgl_arena *arena, size_t size)
+{
+    struct virgl_arena_chunk *chunk = arena->chunks;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+	size_t chunk_size = size;
+
+	/* grow geometrically so a busy frame doesn't chain many chunks */
+	if (chunk && chunk_size < chunk->size * 2)
+	    chunk_size = chunk->size * 2;
+
+	chunk = arena_new_chunk (chunk_size);
+	if (!chunk)
+	    return NULL;
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+    }
+
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void
+virgl_arena_reset (struct virgl_arena *arena)
+{
+    struct virgl_arena_chunk *chunk = arena->chunks;
+    size_t total = 0;
+
+    if (!chunk)
+	return;
+
+    if (!chunk->next)
+    {
+	chunk->used = 0;
+	return;
+    }
+
+    while (chunk)
+    {
+	struct virgl_arena_chunk *next = chunk->next;
+
+	total += chunk->size;
+	free (chunk);
+	chunk = next;
+    }
+
+    /* on failure the next alloc simply starts over with a small chunk */
+    arena->chunks = arena_new_chunk (total);
+}
+
+void
+virgl_arena_fini (struct virgl_arena *arena)
+{
+    struct virgl_arena_chunk *chunk = arena->chunks;
+
+    while (chunk)
+    {
+	struct virgl_arena_chunk *next = chunk->next;
+
+	free (chunk);
+	chunk = next;
+    }
+    arena->chunks = NULL;
+}
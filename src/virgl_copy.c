@@ -0,0 +1,492 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Pixel copy and conversion kernels.
+ *
+ * Whole images move between system memory and resource mappings when a
+ * pixmap is migrated or evicted, and staging uploads copy every row of
+ * PutImage data.  These loops replace pixman_image_composite() for the
+ * format pairs that occur there.  A mapping written this way is not
+ * read by the CPU again, so large copies into one use non-temporal
+ * stores and leave the cache to the rest of the server.
+ *
+ * On x86 the kernels are built with function target attributes and
+ * picked on first use from the CPU's features; on ARM NEON is assumed
+ * when the compiler targets it.  Anything else uses plain C.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "virgl.h"
+
+#if defined(HAVE_FUNC_TARGET_ATTRIBUTE) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define VIRGL_COPY_X86
+#include <immintrin.h>
+#define TARGET(isa) __attribute__ ((target (isa)))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VIRGL_COPY_NEON
+#include <arm_neon.h>
+#endif
+
+/* below this many bytes the destination is as likely to be reused soon */
+#define VIRGL_COPY_STREAM_MIN (256 * 1024)
+
+/* n is bytes for copy, pixels for the conversions */
+typedef void (*virgl_row_func_t) (uint8_t *dst, const uint8_t *src, int n,
+				  Bool stream);
+
+static struct {
+    Bool initialized;
+    Bool streaming;		/* stores need a fence afterwards */
+    virgl_row_func_t copy;
+    virgl_row_func_t xrgb_to_argb;
+    virgl_row_func_t rgb565_to_argb;
+    virgl_row_func_t argb_to_a8;
+} kernels;
+
+/*
+ * Portable versions
+ */
+static void
+copy_c (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    memcpy (dst, src, n);
+}
+
+static void
+xrgb_to_argb_c (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    uint32_t *d = (uint32_t *)dst;
+    const uint32_t *s = (const uint32_t *)src;
+
+    while (n--)
+	*d++ = *s++ | 0xff000000;
+}
+
+static inline uint32_t
+expand_565 (uint32_t p)
+{
+    uint32_t r = (p >> 11) & 0x1f;
+    uint32_t g = (p >> 5) & 0x3f;
+    uint32_t b = p & 0x1f;
+
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+    return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+static void
+rgb565_to_argb_c (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    uint32_t *d = (uint32_t *)dst;
+    const uint16_t *s = (const uint16_t *)src;
+
+    while (n--)
+	*d++ = expand_565 (*s++);
+}
+
+static void
+argb_to_a8_c (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    const uint32_t *s = (const uint32_t *)src;
+
+    while (n--)
+	*dst++ = *s++ >> 24;
+}
+
+#ifdef VIRGL_COPY_X86
+
+/*
+ * SSE2, SSE4.1 and AVX2.  Destination rows are at least 4-byte aligned,
+ * so the C versions handle the few pixels before the vector alignment
+ * and after the last full vector.
+ */
+TARGET ("sse2") static void
+copy_sse2 (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    if (!stream)
+    {
+	memcpy (dst, src, n);
+	return;
+    }
+
+    while (((uintptr_t)dst & 15) && n)
+    {
+	*dst++ = *src++;
+	n--;
+    }
+    for (; n >= 64; n -= 64, dst += 64, src += 64)
+    {
+	__m128i a = _mm_loadu_si128 ((const __m128i *)src);
+	__m128i b = _mm_loadu_si128 ((const __m128i *)(src + 16));
+	__m128i c = _mm_loadu_si128 ((const __m128i *)(src + 32));
+	__m128i d = _mm_loadu_si128 ((const __m128i *)(src + 48));
+
+	_mm_stream_si128 ((__m128i *)dst, a);
+	_mm_stream_si128 ((__m128i *)(dst + 16), b);
+	_mm_stream_si128 ((__m128i *)(dst + 32), c);
+	_mm_stream_si128 ((__m128i *)(dst + 48), d);
+    }
+    for (; n >= 16; n -= 16, dst += 16, src += 16)
+	_mm_stream_si128 ((__m128i *)dst,
+			  _mm_loadu_si128 ((const __m128i *)src));
+    memcpy (dst, src, n);
+}
+
+TARGET ("avx2") static void
+copy_avx2 (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    if (!stream)
+    {
+	memcpy (dst, src, n);
+	return;
+    }
+
+    while (((uintptr_t)dst & 31) && n)
+    {
+	*dst++ = *src++;
+	n--;
+    }
+    for (; n >= 128; n -= 128, dst += 128, src += 128)
+    {
+	__m256i a = _mm256_loadu_si256 ((const __m256i *)src);
+	__m256i b = _mm256_loadu_si256 ((const __m256i *)(src + 32));
+	__m256i c = _mm256_loadu_si256 ((const __m256i *)(src + 64));
+	__m256i d = _mm256_loadu_si256 ((const __m256i *)(src + 96));
+
+	_mm256_stream_si256 ((__m256i *)dst, a);
+	_mm256_stream_si256 ((__m256i *)(dst + 32), b);
+	_mm256_stream_si256 ((__m256i *)(dst + 64), c);
+	_mm256_stream_si256 ((__m256i *)(dst + 96), d);
+    }
+    for (; n >= 32; n -= 32, dst += 32, src += 32)
+	_mm256_stream_si256 ((__m256i *)dst,
+			     _mm256_loadu_si256 ((const __m256i *)src));
+    memcpy (dst, src, n);
+}
+
+TARGET ("sse2") static void
+xrgb_to_argb_sse2 (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    const __m128i alpha = _mm_set1_epi32 (0xff000000);
+    int head = ((16 - ((uintptr_t)dst & 15)) & 15) / 4;
+
+    if (head > n)
+	head = n;
+    xrgb_to_argb_c (dst, src, head, stream);
+    dst += head * 4;
+    src += head * 4;
+    n -= head;
+
+    for (; n >= 4; n -= 4, dst += 16, src += 16)
+    {
+	__m128i p = _mm_or_si128 (_mm_loadu_si128 ((const __m128i *)src),
+				  alpha);
+
+	if (stream)
+	    _mm_stream_si128 ((__m128i *)dst, p);
+	else
+	    _mm_store_si128 ((__m128i *)dst, p);
+    }
+    xrgb_to_argb_c (dst, src, n, stream);
+}
+
+TARGET ("avx2") static void
+xrgb_to_argb_avx2 (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    const __m256i alpha = _mm256_set1_epi32 (0xff000000);
+    int head = ((32 - ((uintptr_t)dst & 31)) & 31) / 4;
+
+    if (head > n)
+	head = n;
+    xrgb_to_argb_c (dst, src, head, stream);
+    dst += head * 4;
+    src += head * 4;
+    n -= head;
+
+    for (; n >= 8; n -= 8, dst += 32, src += 32)
+    {
+	__m256i p = _mm256_or_si256 (
+	    _mm256_loadu_si256 ((const __m256i *)src), alpha);
+
+	if (stream)
+	    _mm256_stream_si256 ((__m256i *)dst, p);
+	else
+	    _mm256_store_si256 ((__m256i *)dst, p);
+    }
+    xrgb_to_argb_c (dst, src, n, stream);
+}
+
+/* four 565 pixels, zero-extended to 32 bits, to a8r8g8b8 */
+TARGET ("sse4.1") static inline __m128i
+expand_565_sse41 (__m128i p)
+{
+    const __m128i mask5 = _mm_set1_epi32 (0x1f);
+    const __m128i mask6 = _mm_set1_epi32 (0x3f);
+    __m128i r = _mm_and_si128 (_mm_srli_epi32 (p, 11), mask5);
+    __m128i g = _mm_and_si128 (_mm_srli_epi32 (p, 5), mask6);
+    __m128i b = _mm_and_si128 (p, mask5);
+
+    r = _mm_or_si128 (_mm_slli_epi32 (r, 3), _mm_srli_epi32 (r, 2));
+    g = _mm_or_si128 (_mm_slli_epi32 (g, 2), _mm_srli_epi32 (g, 4));
+    b = _mm_or_si128 (_mm_slli_epi32 (b, 3), _mm_srli_epi32 (b, 2));
+
+    return _mm_or_si128 (_mm_or_si128 (_mm_set1_epi32 (0xff000000),
+				       _mm_slli_epi32 (r, 16)),
+			 _mm_or_si128 (_mm_slli_epi32 (g, 8), b));
+}
+
+TARGET ("sse4.1") static void
+rgb565_to_argb_sse41 (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    int head = ((16 - ((uintptr_t)dst & 15)) & 15) / 4;
+
+    if (head > n)
+	head = n;
+    rgb565_to_argb_c (dst, src, head, stream);
+    dst += head * 4;
+    src += head * 2;
+    n -= head;
+
+    for (; n >= 8; n -= 8, dst += 32, src += 16)
+    {
+	__m128i p = _mm_loadu_si128 ((const __m128i *)src);
+	__m128i lo = expand_565_sse41 (_mm_cvtepu16_epi32 (p));
+	__m128i hi = expand_565_sse41 (_mm_cvtepu16_epi32 (
+					   _mm_srli_si128 (p, 8)));
+
+	if (stream)
+	{
+	    _mm_stream_si128 ((__m128i *)dst, lo);
+	    _mm_stream_si128 ((__m128i *)(dst + 16), hi);
+	}
+	else
+	{
+	    _mm_store_si128 ((__m128i *)dst, lo);
+	    _mm_store_si128 ((__m128i *)(dst + 16), hi);
+	}
+    }
+    rgb565_to_argb_c (dst, src, n, stream);
+}
+
+TARGET ("sse2") static void
+argb_to_a8_sse2 (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    for (; n >= 16; n -= 16, dst += 16, src += 64)
+    {
+	__m128i a = _mm_srli_epi32 (
+	    _mm_loadu_si128 ((const __m128i *)src), 24);
+	__m128i b = _mm_srli_epi32 (
+	    _mm_loadu_si128 ((const __m128i *)(src + 16)), 24);
+	__m128i c = _mm_srli_epi32 (
+	    _mm_loadu_si128 ((const __m128i *)(src + 32)), 24);
+	__m128i d = _mm_srli_epi32 (
+	    _mm_loadu_si128 ((const __m128i *)(src + 48)), 24);
+
+	_mm_storeu_si128 ((__m128i *)dst,
+			  _mm_packus_epi16 (_mm_packs_epi32 (a, b),
+					    _mm_packs_epi32 (c, d)));
+    }
+    argb_to_a8_c (dst, src, n, stream);
+}
+
+#endif /* VIRGL_COPY_X86 */
+
+#ifdef VIRGL_COPY_NEON
+
+/* NEON has no non-temporal store intrinsic, so stream is ignored */
+static void
+xrgb_to_argb_neon (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    const uint32x4_t alpha = vdupq_n_u32 (0xff000000);
+
+    for (; n >= 4; n -= 4, dst += 16, src += 16)
+	vst1q_u32 ((uint32_t *)dst,
+		   vorrq_u32 (vld1q_u32 ((const uint32_t *)src), alpha));
+    xrgb_to_argb_c (dst, src, n, stream);
+}
+
+static void
+rgb565_to_argb_neon (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    for (; n >= 8; n -= 8, dst += 32, src += 16)
+    {
+	uint16x8_t p = vld1q_u16 ((const uint16_t *)src);
+	uint8x8x4_t out;
+	uint8x8_t r = vshrn_n_u16 (p, 8);
+	uint8x8_t g = vshrn_n_u16 (p, 3);
+	uint8x8_t b = vmovn_u16 (vshlq_n_u16 (p, 3));
+
+	/* replicate the top bits into the low ones */
+	r = vsri_n_u8 (r, r, 5);
+	g = vsri_n_u8 (g, g, 6);
+	b = vsri_n_u8 (b, b, 5);
+
+	out.val[0] = b;
+	out.val[1] = g;
+	out.val[2] = r;
+	out.val[3] = vdup_n_u8 (0xff);
+	vst4_u8 (dst, out);
+    }
+    rgb565_to_argb_c (dst, src, n, stream);
+}
+
+static void
+argb_to_a8_neon (uint8_t *dst, const uint8_t *src, int n, Bool stream)
+{
+    for (; n >= 16; n -= 16, dst += 16, src += 64)
+	vst1q_u8 (dst, vld4q_u8 (src).val[3]);
+    argb_to_a8_c (dst, src, n, stream);
+}
+
+#endif /* VIRGL_COPY_NEON */
+
+static void
+virgl_copy_init (void)
+{
+    kernels.copy = copy_c;
+    kernels.xrgb_to_argb = xrgb_to_argb_c;
+    kernels.rgb565_to_argb = rgb565_to_argb_c;
+    kernels.argb_to_a8 = argb_to_a8_c;
+
+#ifdef VIRGL_COPY_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse2"))
+    {
+	kernels.copy = copy_sse2;
+	kernels.xrgb_to_argb = xrgb_to_argb_sse2;
+	kernels.argb_to_a8 = argb_to_a8_sse2;
+	kernels.streaming = TRUE;
+    }
+    if (__builtin_cpu_supports ("sse4.1"))
+	kernels.rgb565_to_argb = rgb565_to_argb_sse41;
+    if (__builtin_cpu_supports ("avx2"))
+    {
+	kernels.copy = copy_avx2;
+	kernels.xrgb_to_argb = xrgb_to_argb_avx2;
+    }
+#endif
+
+#ifdef VIRGL_COPY_NEON
+    kernels.xrgb_to_argb = xrgb_to_argb_neon;
+    kernels.rgb565_to_argb = rgb565_to_argb_neon;
+    kernels.argb_to_a8 = argb_to_a8_neon;
+#endif
+
+    kernels.initialized = TRUE;
+}
+
+static void
+virgl_copy_rows_func (virgl_row_func_t func, uint8_t *dst, int dst_pitch,
+		      const uint8_t *src, int src_pitch, int n, int height,
+		      Bool stream)
+{
+    stream = stream && kernels.streaming &&
+	(size_t)dst_pitch * height >= VIRGL_COPY_STREAM_MIN;
+
+    while (height--)
+    {
+	func (dst, src, n, stream);
+	dst += dst_pitch;
+	src += src_pitch;
+    }
+
+#ifdef VIRGL_COPY_X86
+    /* streamed stores are weakly ordered; make them visible before the
+     * host is told to read the mapping */
+    if (stream)
+	_mm_sfence ();
+#endif
+}
+
+/* copy rows of width bytes into a resource mapping */
+void
+virgl_copy_rows (uint8_t *dst, int dst_pitch,
+		 const uint8_t *src, int src_pitch, int width, int height)
+{
+    if (!kernels.initialized)
+	virgl_copy_init ();
+
+    virgl_copy_rows_func (kernels.copy, dst, dst_pitch, src, src_pitch,
+			  width, height, TRUE);
+}
+
+/*
+ * Like a PIXMAN_OP_SRC composite of a box of src onto the same box of
+ * dst.  stream is for destinations that the CPU won't read again soon.
+ */
+void
+virgl_convert_image (pixman_image_t *dst, pixman_image_t *src,
+		     int x, int y, int width, int height, Bool stream)
+{
+    pixman_format_code_t df = pixman_image_get_format (dst);
+    pixman_format_code_t sf = pixman_image_get_format (src);
+    int dst_pitch = pixman_image_get_stride (dst);
+    int src_pitch = pixman_image_get_stride (src);
+    virgl_row_func_t func;
+    int n;
+
+    if (!kernels.initialized)
+	virgl_copy_init ();
+
+    if (sf == df)
+    {
+	func = kernels.copy;
+	n = width * PIXMAN_FORMAT_BPP (sf) / 8;
+    }
+    else if (sf == PIXMAN_x8r8g8b8 && df == PIXMAN_a8r8g8b8)
+    {
+	func = kernels.xrgb_to_argb;
+	n = width;
+    }
+    else if (sf == PIXMAN_r5g6b5 &&
+	     (df == PIXMAN_a8r8g8b8 || df == PIXMAN_x8r8g8b8))
+    {
+	func = kernels.rgb565_to_argb;
+	n = width;
+    }
+    else if (sf == PIXMAN_a8r8g8b8 && df == PIXMAN_a8)
+    {
+	func = kernels.argb_to_a8;
+	n = width;
+    }
+    else
+    {
+	pixman_image_composite (PIXMAN_OP_SRC, src, NULL, dst,
+				x, y, 0, 0, x, y, width, height);
+	return;
+    }
+
+    virgl_copy_rows_func (func,
+			  (uint8_t *)pixman_image_get_data (dst) +
+			  y * dst_pitch + x * PIXMAN_FORMAT_BPP (df) / 8,
+			  dst_pitch,
+			  (const uint8_t *)pixman_image_get_data (src) +
+			  y * src_pitch + x * PIXMAN_FORMAT_BPP (sf) / 8,
+			  src_pitch,
+			  n, height, stream);
+}
@@ -93,9 +93,14 @@ virgl_dri2_create_buffer2(ScreenPtr screen, DrawablePtr draw, unsigned int attac
 	if (1 || ppix->usage_hint == CREATE_PIXMAP_USAGE_BACKING_PIXMAP) {
 	    if (!surf->bo) {
 		virgl_kms_3d_resource_migrate(surf);
-		virgl_kms_transfer_block(surf, 0, 0, surf->pixmap->drawable.width, surf->pixmap->drawable.height);
+		/* a window's front is only read through CopyRegion, which
+		 * uploads what it needs; a GLX pixmap is read directly */
+		if (draw->type == DRAWABLE_PIXMAP)
+		    virgl_kms_migrate_region(surf, NULL);
 		ErrorF("migrated pixmap %p %p\n", ppix, surf);
 	    }
+	    /* keep the bo while the client knows its name */
+	    surf->dri2_refs++;
 	}
     } else {
 	int bpp;
@@ -145,8 +150,13 @@ virgl_dri2_destroy_buffer2(ScreenPtr screen, DrawablePtr draw, DRI2BufferPtr buf
     if (!qbuf)
 	return;
 
-    if (qbuf->ppix)
+    if (qbuf->ppix) {
+	struct virgl_surface_t *surf = get_surface(qbuf->ppix);
+
+	if (qbuf->base.attachment == DRI2BufferFrontLeft && surf)
+	    surf->dri2_refs--;
 	screen->DestroyPixmap(qbuf->ppix);
+    }
     free(qbuf);
 }
 
@@ -182,15 +192,28 @@ virgl_dri2_copy_region2(ScreenPtr pScreen, DrawablePtr pDraw, RegionPtr pRegion,
   if (dst->base.attachment == DRI2BufferFrontLeft)
     dst_draw = pDraw;
 
+  /* scratch GCs are cached per depth by the server, so only the clip
+   * region costs an allocation; a single box, which is what a full
+   * swap sends, needs no clip at all */
   pGC = GetScratchGC(pDraw->depth, pScreen);
-  pCopyClip = REGION_CREATE(pScreen, NULL, 0);
-  REGION_COPY(pScreen, pCopyClip, pRegion);
-  pGC->funcs->ChangeClip(pGC, CT_REGION, pCopyClip, 0);
-  ValidateGC(dst_draw, pGC);
-
-  pGC->ops->CopyArea(src_draw, dst_draw, pGC, 0, 0,
-		     pDraw->width, pDraw->height, 0, 0);
-  
+
+  if (REGION_NUM_RECTS(pRegion) == 1) {
+    BoxPtr box = REGION_RECTS(pRegion);
+
+    ValidateGC(dst_draw, pGC);
+    pGC->ops->CopyArea(src_draw, dst_draw, pGC, box->x1, box->y1,
+		       box->x2 - box->x1, box->y2 - box->y1,
+		       box->x1, box->y1);
+  } else if (REGION_NOTEMPTY(pScreen, pRegion)) {
+    pCopyClip = REGION_CREATE(pScreen, NULL, 0);
+    REGION_COPY(pScreen, pCopyClip, pRegion);
+    pGC->funcs->ChangeClip(pGC, CT_REGION, pCopyClip, 0);
+    ValidateGC(dst_draw, pGC);
+
+    pGC->ops->CopyArea(src_draw, dst_draw, pGC, 0, 0,
+		       pDraw->width, pDraw->height, 0, 0);
+  }
+
   FreeScratchGC(pGC);
 
 }
@@ -0,0 +1,150 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * DRI3
+ *
+ * Clients open the device themselves, allocate their own buffers and
+ * hand them to the server as dma-buf fds, so nothing is created on the
+ * server's behalf and no global flink names are involved.  Buffers
+ * going the other way are exported the same way, migrating the pixmap
+ * into a resource first if need be.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xorg-server.h"
+#include "virgl.h"
+
+#ifdef DRI3
+
+#include <fcntl.h>
+#include <unistd.h>
+#include "dri3.h"
+
+static int
+virgl_dri3_open (ScreenPtr screen, RRProviderPtr provider, int *out)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn (screen);
+    virgl_screen_t *virgl = scrn->driverPrivate;
+    drm_magic_t magic;
+    int fd;
+
+    fd = open (virgl->drm_device_name, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+	return BadAlloc;
+
+    /* a render node needs no authentication and refuses to try */
+    if (drmGetMagic (fd, &magic) == 0 &&
+	drmAuthMagic (virgl->drm_fd, magic) < 0)
+    {
+	close (fd);
+	return BadMatch;
+    }
+
+    *out = fd;
+    return Success;
+}
+
+static PixmapPtr
+virgl_dri3_pixmap_from_fd (ScreenPtr screen, int fd,
+			   CARD16 width, CARD16 height, CARD16 stride,
+			   CARD8 depth, CARD8 bpp)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn (screen);
+    virgl_screen_t *virgl = scrn->driverPrivate;
+    virgl_surface_t *surface;
+    PixmapPtr pixmap;
+
+    if (!width || !height || bpp != BitsPerPixel (depth))
+	return NULL;
+
+    surface = virgl_kms_surface_from_fd (virgl, fd, width, height, depth,
+					 stride);
+    if (!surface)
+	return NULL;
+
+    pixmap = screen->CreatePixmap (screen, 0, 0, depth, 0);
+    if (!pixmap)
+    {
+	virgl->bo_funcs->destroy_surface (surface);
+	return NULL;
+    }
+
+    screen->ModifyPixmapHeader (pixmap, width, height, 0, 0, stride, NULL);
+    set_surface (pixmap, surface);
+    virgl_surface_set_pixmap (surface, pixmap);
+
+    return pixmap;
+}
+
+static int
+virgl_dri3_fd_from_pixmap (ScreenPtr screen, PixmapPtr pixmap,
+			   CARD16 *stride, CARD32 *size)
+{
+    virgl_surface_t *surface = get_surface (pixmap);
+    uint32_t bo_size;
+    int fd;
+
+    if (!surface)
+	return -1;
+
+    if (!surface->bo)
+	virgl_kms_3d_resource_migrate (surface);
+
+    /* the client reads the resource directly from now on */
+    virgl_kms_migrate_region (surface, NULL);
+
+    if (!surface->bo ||
+	virgl_kms_bo_export_fd (surface->bo, &fd, &bo_size))
+	return -1;
+
+    /* there's no telling when the client lets go, so it stays put */
+    surface->dri2_refs++;
+
+    *stride = pixman_image_get_stride (surface->host_image);
+    *size = bo_size;
+    return fd;
+}
+
+static dri3_screen_info_rec virgl_dri3_info = {
+    .version = 0,
+    .open = virgl_dri3_open,
+    .pixmap_from_fd = virgl_dri3_pixmap_from_fd,
+    .fd_from_pixmap = virgl_dri3_fd_from_pixmap,
+};
+
+Bool
+virgl_dri3_init (ScreenPtr screen)
+{
+    return dri3_screen_init (screen, &virgl_dri3_info);
+}
+
+#else /* !DRI3 */
+
+Bool
+virgl_dri3_init (ScreenPtr screen)
+{
+    return FALSE;
+}
+
+#endif
@@ -270,32 +270,110 @@ drmmode_show_cursor (xf86CrtcPtr crtc)
 {
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	uint32_t handle = virgl_kms_bo_get_handle(drmmode_crtc->cursor_bo);
-
 	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
 	CursorPtr cursor = xf86_config->cursor;
+	uint32_t handle;
+
+	if (drmmode_crtc->cursor < 0)
+		return;
+	handle = virgl_kms_bo_get_handle(drmmode_crtc->cursors[drmmode_crtc->cursor].bo);
 
+	/* the same image at the same hotspot is already up */
+	if (drmmode_crtc->cursor_shown == handle &&
+	    drmmode_crtc->cursor_xhot == cursor->bits->xhot &&
+	    drmmode_crtc->cursor_yhot == cursor->bits->yhot)
+		return;
+
+	/* the image's transfer may still be queued behind other work */
+	virgl_flush_sync(crtc->scrn->driverPrivate);
 	drmModeSetCursor2(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id, handle,
 		64, 64, cursor->bits->xhot, cursor->bits->yhot);
+	drmmode_crtc->cursor_shown = handle;
+	drmmode_crtc->cursor_xhot = cursor->bits->xhot;
+	drmmode_crtc->cursor_yhot = cursor->bits->yhot;
 }
 
+static uint32_t
+drmmode_cursor_hash(const uint32_t *image)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < 64 * 64; i++)
+		hash = (hash ^ image[i]) * 16777619u;
+	return hash;
+}
+
+/*
+ * Cursors are cached by image, so that going back to a recent one only
+ * selects its resource again.  A new image takes a free slot while
+ * there are any and then the least recently used one other than the
+ * one up on the CRTC.
+ */
 static void
 drmmode_load_cursor_argb (xf86CrtcPtr crtc, CARD32 *image)
 {
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	virgl_screen_t *virgl = crtc->scrn->driverPrivate;
+	uint32_t hash = drmmode_cursor_hash(image);
+	drmmode_cursor_ptr slot = NULL;
+	Bool hit = FALSE, reused = FALSE;
 	int i;
-	uint32_t *ptr;
 
-	if (!drmmode_crtc->cursor_ptr)
-	  return;
-	/* cursor should be mapped already */
-	ptr = (uint32_t *)(drmmode_crtc->cursor_ptr);
+	for (i = 0; i < drmmode_crtc->num_cursors; i++) {
+		drmmode_cursor_ptr c = &drmmode_crtc->cursors[i];
 
-	for (i = 0; i < 64 * 64; i++)
-		ptr[i] = image[i];
+		if (c->last_used && c->hash == hash &&
+		    !memcmp(c->ptr, image, 64 * 64 * 4)) {
+			slot = c;
+			hit = TRUE;
+			break;
+		}
+	}
+
+	if (!slot) {
+		for (i = 0; i < drmmode_crtc->num_cursors; i++) {
+			drmmode_cursor_ptr c = &drmmode_crtc->cursors[i];
 
-	drmmode_show_cursor(crtc);
+			if (i == drmmode_crtc->cursor)
+				continue;
+			if (!slot || c->last_used < slot->last_used)
+				slot = c;
+		}
+		/* a slot that never held an image needs no waiting on */
+		reused = slot && slot->last_used;
+	}
+
+	if ((!slot || reused) &&
+	    drmmode_crtc->num_cursors < DRMMODE_CURSOR_CACHE) {
+		drmmode_cursor_ptr c = &drmmode_crtc->cursors[drmmode_crtc->num_cursors];
+
+		c->bo = virgl_bo_create_argb_cursor_resource(virgl, 64, 64);
+		if (c->bo) {
+			c->ptr = virgl->bo_funcs->bo_map(c->bo);
+			drmmode_crtc->num_cursors++;
+			slot = c;
+			reused = FALSE;
+		}
+	}
+
+	if (!slot)
+		return;
+	i = slot - drmmode_crtc->cursors;
+
+	if (!hit) {
+		if (!slot->ptr)
+			return;
+		virgl_bo_write_cursor(virgl, slot->bo, image, 64, 64, reused);
+		slot->hash = hash;
+	}
+
+	slot->last_used = ++drmmode_crtc->cursor_serial;
+	drmmode_crtc->cursor = i;
+
+	/* loads while hidden are shown by show_cursor */
+	if (drmmode_crtc->cursor_shown)
+		drmmode_show_cursor(crtc);
 }
 
 static void
@@ -303,9 +381,9 @@ drmmode_hide_cursor (xf86CrtcPtr crtc)
 {
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	int ret;
-	
+
 	drmModeSetCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id, 0, 64, 64);
+	drmmode_crtc->cursor_shown = 0;
 }
 
 static void
@@ -347,19 +425,44 @@ drmmode_crtc_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num)
 	drmmode_crtc->drmmode = drmmode;
 	crtc->driver_private = drmmode_crtc;
 
-	{
-		int cursor_size = 64*4*64;
+	/* the first cursor resource is made now so a failure shows early */
+	drmmode_crtc->cursor = -1;
+	drmmode_crtc->cursors[0].bo = virgl_bo_create_argb_cursor_resource(virgl, 64, 64);
+	if (!drmmode_crtc->cursors[0].bo) {
+		ErrorF("failed to allocate cursor buffer\n");
+		return;
+	}
+	drmmode_crtc->cursors[0].ptr = virgl->bo_funcs->bo_map(drmmode_crtc->cursors[0].bo);
+	drmmode_crtc->num_cursors = 1;
 
-		drmmode_crtc->cursor_bo = virgl_bo_create_argb_cursor_resource(virgl, 64, 64);
-		if (!drmmode_crtc->cursor_bo) {
-			ErrorF("failed to allocate cursor buffer\n");
-			return;
-		}
+	return;
+}
+
+/*
+ * Release every cached cursor resource.  A later generation makes them
+ * again on demand in load_cursor_argb.
+ */
+void
+drmmode_cursor_fini(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	virgl_screen_t *virgl = pScrn->driverPrivate;
+	int c, i;
+
+	for (c = 0; c < xf86_config->num_crtc; c++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+			xf86_config->crtc[c]->driver_private;
+
+		for (i = 0; i < drmmode_crtc->num_cursors; i++) {
+			drmmode_cursor_ptr slot = &drmmode_crtc->cursors[i];
 
-		drmmode_crtc->cursor_ptr = virgl->bo_funcs->bo_map(drmmode_crtc->cursor_bo);
+			virgl->bo_funcs->bo_decref(virgl, slot->bo);
+			memset(slot, 0, sizeof(*slot));
+		}
+		drmmode_crtc->num_cursors = 0;
+		drmmode_crtc->cursor = -1;
+		drmmode_crtc->cursor_shown = 0;
 	}
-	
-	return;
 }
 
 
@@ -862,4 +965,151 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int cpp)
 	return TRUE;
 }
 
+/*
+ * DRM events
+ *
+ * The fd is watched by the server like any client socket, and page flip
+ * and vblank completions are dispatched from there to whoever queued
+ * them, so nothing ever waits for the display.  The kernel hands back a
+ * sequence number rather than a pointer, so that an entry can go away
+ * before its event arrives.
+ */
+struct drmmode_event {
+	struct xorg_list link;
+	drmmode_ptr drmmode;
+	uint32_t seq;
+	void *data;
+	drmmode_event_handler_proc handler;
+	drmmode_event_abort_proc abort;
+};
+
+static struct xorg_list drmmode_events;
+static uint32_t drmmode_event_seq;
+
+static void
+drmmode_event_handler(int fd, unsigned int frame, unsigned int sec,
+		      unsigned int usec, void *user_data)
+{
+	uint32_t seq = (uintptr_t)user_data;
+	struct drmmode_event *e;
+
+	xorg_list_for_each_entry(e, &drmmode_events, link) {
+		if (e->seq == seq) {
+			xorg_list_del(&e->link);
+			e->handler(frame, (uint64_t)sec * 1000000 + usec,
+				   e->data);
+			free(e);
+			break;
+		}
+	}
+}
+
+/**
+ * Queues a handler for the event the caller is about to request; pass
+ * the returned sequence number, cast to a pointer, as the event's user
+ * data.  Returns 0 on failure.
+ */
+uint32_t
+drmmode_event_queue(drmmode_ptr drmmode, void *data,
+		    drmmode_event_handler_proc handler,
+		    drmmode_event_abort_proc abort)
+{
+	struct drmmode_event *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return 0;
+
+	if (!++drmmode_event_seq)
+		++drmmode_event_seq;
+	e->drmmode = drmmode;
+	e->seq = drmmode_event_seq;
+	e->data = data;
+	e->handler = handler;
+	e->abort = abort;
+	xorg_list_append(&e->link, &drmmode_events);
+
+	return e->seq;
+}
+
+/* drops an entry whose event could not be requested after all */
+void
+drmmode_event_cancel(uint32_t seq)
+{
+	struct drmmode_event *e;
+
+	xorg_list_for_each_entry(e, &drmmode_events, link) {
+		if (e->seq == seq) {
+			xorg_list_del(&e->link);
+			free(e);
+			break;
+		}
+	}
+}
+
+#if HAVE_NOTIFY_FD
+static void
+drmmode_notify_fd(int fd, int notify, void *data)
+{
+	drmmode_ptr drmmode = data;
+
+	drmHandleEvent(fd, &drmmode->event_context);
+}
+#else
+static void
+drmmode_wakeup_handler(pointer data, int err, pointer p)
+{
+	drmmode_ptr drmmode = data;
+	fd_set *read_mask = p;
+
+	if (err >= 0 && FD_ISSET(drmmode->fd, read_mask))
+		drmHandleEvent(drmmode->fd, &drmmode->event_context);
+}
+#endif
+
+void
+drmmode_event_init(drmmode_ptr drmmode)
+{
+	if (!drmmode_events.next)
+		xorg_list_init(&drmmode_events);
+
+	drmmode->event_context.version = 2;
+	drmmode->event_context.vblank_handler = drmmode_event_handler;
+	drmmode->event_context.page_flip_handler = drmmode_event_handler;
+
+#if HAVE_NOTIFY_FD
+	SetNotifyFd(drmmode->fd, drmmode_notify_fd, X_NOTIFY_READ, drmmode);
+#else
+	AddGeneralSocket(drmmode->fd);
+	RegisterBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
+				       drmmode_wakeup_handler, drmmode);
+#endif
+}
+
+void
+drmmode_event_fini(drmmode_ptr drmmode)
+{
+	struct drmmode_event *e, *tmp;
+
+	if (!drmmode_events.next)
+		return;
+
+#if HAVE_NOTIFY_FD
+	RemoveNotifyFd(drmmode->fd);
+#else
+	RemoveGeneralSocket(drmmode->fd);
+	RemoveBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
+				     drmmode_wakeup_handler, drmmode);
+#endif
+
+	xorg_list_for_each_entry_safe(e, tmp, &drmmode_events, link) {
+		if (e->drmmode != drmmode)
+			continue;
+		xorg_list_del(&e->link);
+		if (e->abort)
+			e->abort(e->data);
+		free(e);
+	}
+}
+
 #endif
@@ -42,15 +42,36 @@ typedef struct {
   drmModeFBPtr mode_fb;
   int cpp;
   ScrnInfoPtr scrn;
+  drmEventContext event_context;
 } drmmode_rec, *drmmode_ptr;
 
+/* completion of a page flip or vblank wait queued with drmmode_event_queue */
+typedef void (*drmmode_event_handler_proc)(uint64_t frame, uint64_t usec,
+					   void *data);
+/* the event will never come, the screen is going away */
+typedef void (*drmmode_event_abort_proc)(void *data);
+
+/* recently used cursor images, each in a resource of its own */
+#define DRMMODE_CURSOR_CACHE 8
+
+typedef struct {
+    struct virgl_bo *bo;
+    void *ptr;
+    uint32_t hash;
+    uint32_t last_used;
+} drmmode_cursor_rec, *drmmode_cursor_ptr;
+
 typedef struct {
     drmmode_ptr drmmode;
     drmModeCrtcPtr mode_crtc;
     int hw_id;
-    struct virgl_bo *cursor_bo;
-    void *cursor_ptr;
-  uint32_t cursor_res_handle;
+    drmmode_cursor_rec cursors[DRMMODE_CURSOR_CACHE];
+    int num_cursors;
+    int cursor;			/* the one loaded, -1 for none */
+    uint32_t cursor_serial;
+    /* what the CRTC was last told to show, 0 when hidden */
+    uint32_t cursor_shown;
+    int cursor_xhot, cursor_yhot;
   //    struct radeon_bo *rotate_bo;
     unsigned rotate_fb_id;
     int dpms_mode;
@@ -79,6 +100,14 @@ typedef struct {
 } drmmode_output_private_rec, *drmmode_output_private_ptr;
 
 extern Bool drmmode_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int cpp);
+extern void drmmode_cursor_fini(ScrnInfoPtr pScrn);
+
+extern void drmmode_event_init(drmmode_ptr drmmode);
+extern void drmmode_event_fini(drmmode_ptr drmmode);
+extern uint32_t drmmode_event_queue(drmmode_ptr drmmode, void *data,
+				    drmmode_event_handler_proc handler,
+				    drmmode_event_abort_proc abort);
+extern void drmmode_event_cancel(uint32_t seq);
 #endif
 
 #endif
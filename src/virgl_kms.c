@@ -6,12 +6,34 @@
 
 
 #include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
 #include "virgl.h"
 #include "xf86platformBus.h"
 
 static void graw_flush_eq(struct graw_encoder_state *eq, void *closure);
+static int virgl_3d_transfer_to_host(virgl_screen_t *virgl, struct virgl_bo *_bo,
+				 struct drm_virtgpu_3d_box *transfer_box,
+				 uint32_t stride,
+				 uint32_t offset,
+				 uint32_t level);
+static int virgl_3d_wait(virgl_screen_t *virgl, struct virgl_bo *_bo);
+static void virgl_kms_enforce_budget(virgl_screen_t *virgl);
+static void virgl_kms_migrate_step(virgl_screen_t *virgl);
+
+static const OptionInfoRec DefaultOptions[] = {
+    { OPTION_SIMULATE_DEVICE,
+      "SimulateDevice",           OPTV_BOOLEAN, { 0 }, FALSE },
+    { OPTION_SIMULATE_LATENCY,
+      "SimulateLatency",          OPTV_STRING,  { 0 }, FALSE },
+    { OPTION_SUBMIT_THREAD,
+      "SubmitThread",             OPTV_BOOLEAN, { 0 }, FALSE },
+    { OPTION_VIDEO_MEMORY_BUDGET,
+      "VideoMemoryBudget",        OPTV_INTEGER, { 0 }, FALSE },
+    { -1, NULL, OPTV_NONE, { 0 }, FALSE }
+};
 
 static Bool virgl_open_drm_master(ScrnInfoPtr pScrn)
 {
@@ -80,8 +102,10 @@ static int dispatch_dirty_region(ScrnInfoPtr scrn,
     RegionPtr dirty = DamageRegion(damage);
     unsigned num_cliprects = REGION_NUM_RECTS(dirty);
     if (num_cliprects) {
-        drmModeClip *clip = malloc(num_cliprects * sizeof(drmModeClip));
+        drmModeClip *clip = virgl_arena_alloc(&virgl->scratch,
+                                              num_cliprects * sizeof(drmModeClip));
         BoxPtr rect = REGION_RECTS(dirty);
+        uint64_t start;
         int i, ret;
 
         if (!clip)
@@ -96,8 +120,17 @@ static int dispatch_dirty_region(ScrnInfoPtr scrn,
         }
 
         /* TODO query connector property to see if this is needed */
-        ret = drmModeDirtyFB(virgl->drm_fd, fb_id, clip, num_cliprects);
-        free(clip);
+        if (virgl->submit &&
+            virgl_submit_dirty_fb(virgl, fb_id, clip, num_cliprects)) {
+            ret = 0;
+        } else {
+            /* must not overtake the rendering still queued */
+            if (virgl->submit)
+                virgl_submit_sync(virgl);
+            start = virgl_stats_now();
+            ret = drmModeDirtyFB(virgl->drm_fd, fb_id, clip, num_cliprects);
+            virgl_stats_ioctl(virgl, VIRGL_STAT_DIRTYFB, start);
+        }
         DamageEmpty(damage);
         if (ret) {
             if (ret == -EINVAL)
@@ -131,6 +164,13 @@ static void virglBlockHandler(BLOCKHANDLER_ARGS_DECL)
     graw_flush_eq(virgl->gr_enc, NULL);
 
     dispatch_dirty(pScreen);
+
+    virgl_kms_migrate_step(virgl);
+    virgl_kms_enforce_budget(virgl);
+
+    virgl_stats_check(pScreen);
+
+    virgl_arena_reset(&virgl->scratch);
 }
 
 void virgl_flush(virgl_screen_t *virgl)
@@ -138,23 +178,78 @@ void virgl_flush(virgl_screen_t *virgl)
     graw_flush_eq(virgl->gr_enc, NULL);
 }
 
+/* flush, and with a submission thread wait until the kernel has it all,
+ * for ioctls that bypass the queue and must not overtake it */
+void virgl_flush_sync(virgl_screen_t *virgl)
+{
+    graw_flush_eq(virgl->gr_enc, NULL);
+    if (virgl->submit)
+	virgl_submit_sync(virgl);
+}
+
 static Bool
 virgl_close_screen_kms (CLOSE_SCREEN_ARGS_DECL)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn (pScreen);
     virgl_screen_t *virgl = pScrn->driverPrivate;
     Bool result;
+    int i;
+
+    virgl_stats_dump(pScreen);
 
     if (virgl->has_3d_accel)
 	virgl_dri2_fini(pScreen);
 
+    virgl_present_fini(pScreen);
+    drmmode_event_fini(&virgl->drmmode);
+    drmmode_cursor_fini(pScrn);
+
+    if (virgl->copy_scratch)
+    {
+	virgl->bo_funcs->bo_decref (virgl, virgl->copy_scratch);
+	virgl->copy_scratch = NULL;
+    }
+
+    for (i = 0; i < VIRGL_SOLID_SLAB_DEPTHS; i++)
+    {
+	if (virgl->solid_slab[i].bo)
+	    virgl->bo_funcs->bo_decref (virgl, virgl->solid_slab[i].bo);
+	virgl->solid_slab[i].bo = NULL;
+	virgl->solid_slab[i].count = 0;
+    }
+
+    virgl_flush (virgl);
+    virgl_kms_staging_fini (virgl);
+
+    virgl_arena_fini (&virgl->scratch);
+
+    virgl_submit_fini (virgl);
+
     pScreen->CloseScreen = virgl->close_screen;
 
     result = pScreen->CloseScreen (CLOSE_SCREEN_ARGS);
 
+    /* the device itself stays, PreInit set it up */
+    virgl_sim_fini (virgl);
+
     return result;
 }
 
+static void
+virgl_free_screen_kms (FREE_SCREEN_ARGS_DECL)
+{
+    SCRN_INFO_PTR (arg);
+    virgl_screen_t *virgl = pScrn->driverPrivate;
+
+    if (!virgl)
+	return;
+
+    free (virgl->sim);
+    free (virgl->options);
+    virgl->sim = NULL;
+    virgl->options = NULL;
+}
+
 static Bool
 virgl_color_setup (ScrnInfoPtr pScrn)
 {
@@ -194,8 +289,7 @@ static Bool virgl_has_3d_accel(virgl_screen_t *virgl)
     param.param = VIRTGPU_PARAM_3D_FEATURES;
     param.value = (uintptr_t)&tmp;
 
-    r = drmCommandWriteRead(virgl->drm_fd, DRM_VIRTGPU_GETPARAM, &param,
-			    sizeof(param));
+    r = virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_GETPARAM, &param);
     if (r)
 	return FALSE;
 
@@ -227,6 +321,10 @@ Bool virgl_pre_init_kms(ScrnInfoPtr pScrn, int flags)
     virgl->entity = xf86GetEntityInfo (pScrn->entityList[0]);
     virgl->kms_enabled = TRUE;
     xorg_list_init(&virgl->ums_bos);
+    xorg_list_init(&virgl->kms_bos);
+    xorg_list_init(&virgl->surface_lru);
+    xorg_list_init(&virgl->migrating);
+    xorg_list_init(&virgl->present_vblanks);
 
     virgl_kms_setup_funcs(virgl);
     if (virgl->entity->location.type == BUS_PCI) {
@@ -236,12 +334,26 @@ Bool virgl_pre_init_kms(ScrnInfoPtr pScrn, int flags)
 
     pScrn->monitor = pScrn->confScreen->monitor;
 
+    xf86CollectOptions (pScrn, NULL);
+    if (!(virgl->options = malloc (sizeof (DefaultOptions))))
+	goto out;
+    memcpy (virgl->options, DefaultOptions, sizeof (DefaultOptions));
+    xf86ProcessOptions (scrnIndex, pScrn->options, virgl->options);
+
     if (virgl_open_drm_master(pScrn) == FALSE) {
 	xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Kernel modesetting setup failed\n");
 	goto out;
     }
 
+    if (xf86ReturnOptValBool(virgl->options, OPTION_SIMULATE_DEVICE, FALSE) &&
+	!virgl_sim_init(virgl, xf86GetOptValString(virgl->options,
+						    OPTION_SIMULATE_LATENCY)))
+	goto out;
+
     virgl->has_3d_accel = virgl_has_3d_accel(virgl);
+    virgl->has_blob = virgl->has_3d_accel && virgl_has_blob_resources(virgl);
+    if (virgl->has_blob)
+	xf86DrvMsg(scrnIndex, X_INFO, "Using host-visible blob resources\n");
 
     if (!virgl_color_setup(pScrn))
 	goto out;
@@ -303,7 +415,7 @@ virgl_create_screen_resources_kms(ScreenPtr pScreen)
     set_surface (pPixmap, virgl->primary);
     virgl_surface_set_pixmap (virgl->primary, pPixmap);
 
-    virgl->gr_enc = graw_encoder_init_queue(virgl->drm_fd);
+    virgl->gr_enc = graw_encoder_init_queue(virgl);
     virgl->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
 			       pScreen, pPixmap);
     if (virgl->damage) {
@@ -352,6 +464,10 @@ virgl_leave_vt_kms (VT_FUNC_ARGS_DECL)
     xf86_hide_cursors (pScrn);
     //    pScrn->EnableDisableFBAccess (XF86_SCRN_ARG (pScrn), FALSE);
 
+    virgl_flush (virgl);
+    if (virgl->submit)
+	virgl_submit_sync (virgl);
+
     ret = drmDropMaster(virgl->drm_fd);
     if (ret) {
 	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
@@ -413,6 +529,7 @@ Bool virgl_screen_init_kms(SCREEN_INIT_ARGS_DECL)
     virgl_screen_t * virgl = pScrn->driverPrivate;
     VisualPtr      visual;
     uint64_t n_surf;
+    int budget;
 
     miClearVisualTypes ();
     if (!miSetVisualTypes (pScrn->depth, miGetDefaultVisualMask (pScrn->depth),
@@ -448,9 +565,14 @@ Bool virgl_screen_init_kms(SCREEN_INIT_ARGS_DECL)
     pScreen->SaveScreen = virgl_blank_screen;
 
     if (virgl->has_3d_accel)
+    {
 	virgl_dri2_init(pScreen);
+	virgl_dri3_init(pScreen);
+    }
 
     virgl_uxa_init (virgl, pScreen);
+    drmmode_event_init (&virgl->drmmode);
+    virgl_present_init (pScreen);
 
     DamageSetup (pScreen);
 
@@ -483,6 +605,19 @@ Bool virgl_screen_init_kms(SCREEN_INIT_ARGS_DECL)
 
     virgl->BlockHandler = pScreen->BlockHandler;
     pScreen->BlockHandler = virglBlockHandler;
+
+    virgl_stats_init(pScreen);
+
+    if (xf86ReturnOptValBool(virgl->options, OPTION_SUBMIT_THREAD, FALSE))
+	virgl_submit_init(virgl);
+
+    if (xf86GetOptValInteger(virgl->options, OPTION_VIDEO_MEMORY_BUDGET,
+			     &budget) && budget > 0) {
+	virgl->bo_budget = (uint64_t)budget << 20;
+	xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+		   "Video memory budget: %d MiB\n", budget);
+    }
+
     return virgl_enter_vt_kms(VT_FUNC_ARGS);
  out:
     return FALSE;
@@ -498,8 +633,82 @@ struct virgl_kms_bo {
     int refcnt;
     uint32_t kname;
     uint32_t res_handle;
+    Bool blob;		/* mapping is host memory, no transfers needed */
 };
 
+static enum virgl_stat_ioctl virgl_ioctl_stat(unsigned long request)
+{
+    switch (request) {
+    case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE:
+#ifdef DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB
+    case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB:
+#endif
+	return VIRGL_STAT_RESOURCE_CREATE;
+    case DRM_IOCTL_VIRTGPU_MAP:
+	return VIRGL_STAT_MAP;
+    case DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST:
+	return VIRGL_STAT_TRANSFER_TO_HOST;
+    case DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST:
+	return VIRGL_STAT_TRANSFER_FROM_HOST;
+    case DRM_IOCTL_VIRTGPU_EXECBUFFER:
+	return VIRGL_STAT_EXECBUFFER;
+    case DRM_IOCTL_VIRTGPU_WAIT:
+	return VIRGL_STAT_WAIT;
+    case DRM_IOCTL_GEM_CLOSE:
+	return VIRGL_STAT_GEM_CLOSE;
+    default:
+	return VIRGL_STAT_OTHER;
+    }
+}
+
+/*
+ * Every ioctl on the device goes through here.  With a submission thread
+ * the ones that only push work are queued, all others wait for the
+ * queue to drain first.
+ */
+int virgl_ioctl(virgl_screen_t *virgl, unsigned long request, void *arg)
+{
+    if (virgl->submit) {
+	if (virgl_submit_ioctl(virgl, request, arg))
+	    return 0;
+	virgl_submit_sync(virgl);
+    }
+
+    return virgl_do_ioctl(virgl, request, arg);
+}
+
+/* issue an ioctl right away and account for it in stats[] */
+int virgl_issue_ioctl(virgl_screen_t *virgl, unsigned long request, void *arg,
+		      struct virgl_ioctl_stats *stats)
+{
+    uint64_t start = virgl_stats_now();
+    enum virgl_stat_ioctl which = virgl_ioctl_stat(request);
+    int ret;
+
+    if (virgl->sim)
+	ret = virgl_sim_ioctl(virgl, which, request, arg);
+    else
+	ret = drmIoctl(virgl->drm_fd, request, arg);
+    virgl_stats_record(&stats[which], start);
+    return ret;
+}
+
+int virgl_do_ioctl(virgl_screen_t *virgl, unsigned long request, void *arg)
+{
+    return virgl_issue_ioctl(virgl, request, arg, virgl->stats.ioctl);
+}
+
+static int virgl_format_cpp(uint32_t format)
+{
+    if (format == 2 || format == 1)
+	return 4;
+    else if (format == 10)
+	return 1;
+    else if (format == 7)
+	return 2;
+    return 4;
+}
+
 static struct virgl_bo *virgl_bo_alloc(virgl_screen_t *virgl,
 				       uint32_t target, uint32_t format, uint32_t bind,
 				       uint32_t width, uint32_t height, int flags)
@@ -508,16 +717,10 @@ static struct virgl_bo *virgl_bo_alloc(virgl_screen_t *virgl,
     struct virgl_kms_bo *bo;
     int ret;
     uint32_t size;
-    int bpp = 4;
+    int bpp = virgl_format_cpp(format);
+    int stride = virgl_stride(width, bpp);
 
-    if (format == 2 || format == 1)
-	bpp = 4;
-    else if (format == 10)
-	bpp = 1;
-    else if (format == 7)
-	bpp = 2;
-
-    size = width * height * bpp;
+    size = stride * height;
     bo = calloc(1, sizeof(struct virgl_kms_bo));
     if (!bo)
 	return NULL;
@@ -531,10 +734,10 @@ static struct virgl_bo *virgl_bo_alloc(virgl_screen_t *virgl,
     create.depth = 1;
     create.array_size = 1;
     create.size = size;
-    create.stride = width * bpp;
+    create.stride = stride;
     create.flags = flags;
 
-    ret = drmIoctl(virgl->drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE, &create);
+    ret = virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE, &create);
     if (ret) {
         xf86DrvMsg(virgl->pScrn->scrnIndex, X_ERROR,
                    "error doing VIRGL resource create\n");
@@ -543,14 +746,167 @@ static struct virgl_bo *virgl_bo_alloc(virgl_screen_t *virgl,
     }
 
  out:
+    virgl->bo_bytes += size;
     bo->size = size;
     bo->handle = create.bo_handle;
     bo->res_handle = create.res_handle;
     bo->virgl = virgl;
     bo->refcnt = 1;
+    xorg_list_append(&bo->bos, &virgl->kms_bos);
     return (struct virgl_bo *)bo;
 }
 
+/*
+ * Blob resources
+ *
+ * When the kernel and host support host-visible blobs, a resource can be
+ * created whose guest mapping is the host's own memory.  CPU writes are
+ * then seen by the host directly and transfers become unnecessary; a
+ * readback only has to wait for the host to finish queued commands.
+ *
+ * The host resource is created by a PIPE_RESOURCE_CREATE command passed
+ * along with the blob ioctl.  A linear layout is requested, but the host
+ * picks the stride and does not report it.  Blobs are only used when the
+ * tight pitch is already aligned for any allocator we know of, so that
+ * the host cannot have chosen another; other widths keep a plain
+ * resource and transfers.
+ */
+#ifdef DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB
+
+#define GRAW_PIPE_RESOURCE_CREATE 48
+#define VIRGL_BIND_LINEAR (1 << 22)
+#define VIRGL_BLOB_PITCH_ALIGN 256	/* bytes */
+
+static Bool virgl_has_blob_resources(virgl_screen_t *virgl)
+{
+    static const uint64_t params[] = {
+	VIRTGPU_PARAM_RESOURCE_BLOB,
+	VIRTGPU_PARAM_HOST_VISIBLE,
+    };
+    struct drm_virtgpu_getparam param;
+    int i;
+
+    for (i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+	uint64_t value = 0;
+
+	memset(&param, 0, sizeof(param));
+	param.param = params[i];
+	param.value = (uintptr_t)&value;
+	if (virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_GETPARAM, &param) || !value)
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+static struct virgl_bo *virgl_bo_alloc_blob(virgl_screen_t *virgl,
+					    uint32_t format, uint32_t bind,
+					    uint32_t width, uint32_t height,
+					    int *stride)
+{
+    struct drm_virtgpu_resource_create_blob create;
+    struct virgl_kms_bo *bo;
+    uint32_t cmd[12];
+    uint32_t pitch;
+    int cpp = virgl_format_cpp(format);
+
+    pitch = width * cpp;
+    if (pitch % VIRGL_BLOB_PITCH_ALIGN)
+	return NULL;
+
+    bo = calloc(1, sizeof(struct virgl_kms_bo));
+    if (!bo)
+	return NULL;
+
+    cmd[0] = (GRAW_PIPE_RESOURCE_CREATE | (11 << 16));
+    cmd[1] = format;
+    cmd[2] = bind | VIRGL_BIND_LINEAR;
+    cmd[3] = 2;			/* target: 2D texture */
+    cmd[4] = width;
+    cmd[5] = height;
+    cmd[6] = 1;			/* depth */
+    cmd[7] = 1;			/* array size */
+    cmd[8] = 0;			/* last level */
+    cmd[9] = 0;			/* samples */
+    cmd[10] = 0;		/* flags */
+    cmd[11] = ++virgl->next_blob_id;
+
+    memset(&create, 0, sizeof(create));
+    create.blob_mem = VIRTGPU_BLOB_MEM_HOST3D;
+    create.blob_flags = VIRTGPU_BLOB_FLAG_USE_MAPPABLE;
+    create.size = (pitch * height + 4095) & ~4095;
+    create.cmd = (uintptr_t)cmd;
+    create.cmd_size = sizeof(cmd);
+    create.blob_id = cmd[11];
+
+    if (virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB, &create)) {
+	free(bo);
+	return NULL;
+    }
+
+    virgl->bo_bytes += create.size;
+    bo->size = create.size;
+    bo->handle = create.bo_handle;
+    bo->res_handle = create.res_handle;
+    bo->virgl = virgl;
+    bo->refcnt = 1;
+    bo->blob = TRUE;
+    xorg_list_append(&bo->bos, &virgl->kms_bos);
+    *stride = pitch;
+    return (struct virgl_bo *)bo;
+}
+
+/* wait for the host to finish everything submitted so far */
+static void virgl_blob_sync(virgl_screen_t *virgl)
+{
+    struct drm_virtgpu_execbuffer eb;
+    uint32_t nop = 0;
+    struct pollfd pfd;
+
+    graw_flush_eq(virgl->gr_enc, NULL);
+    if (!virgl->blob_pending)
+	return;
+
+    if (virgl->submit)
+	virgl_submit_sync(virgl);
+
+    memset(&eb, 0, sizeof(eb));
+    eb.flags = VIRTGPU_EXECBUF_FENCE_FD_OUT;
+    eb.command = (uintptr_t)&nop;
+    eb.size = sizeof(nop);
+    eb.fence_fd = -1;
+    if (virgl_do_ioctl(virgl, DRM_IOCTL_VIRTGPU_EXECBUFFER, &eb) ||
+	eb.fence_fd < 0)
+	return;
+
+    pfd.fd = eb.fence_fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) < 0 && (errno == EINTR || errno == EAGAIN))
+	;
+    close(eb.fence_fd);
+    virgl->blob_pending = FALSE;
+}
+
+#else
+
+static Bool virgl_has_blob_resources(virgl_screen_t *virgl)
+{
+    return FALSE;
+}
+
+static struct virgl_bo *virgl_bo_alloc_blob(virgl_screen_t *virgl,
+					    uint32_t format, uint32_t bind,
+					    uint32_t width, uint32_t height,
+					    int *stride)
+{
+    return NULL;
+}
+
+static void virgl_blob_sync(virgl_screen_t *virgl)
+{
+}
+
+#endif
+
 static void *virgl_bo_map(struct virgl_bo *_bo)
 {
     struct virgl_kms_bo *bo = (struct virgl_kms_bo *)_bo;
@@ -569,7 +925,7 @@ static void *virgl_bo_map(struct virgl_bo *_bo)
 
     virgl_map.handle = bo->handle;
 
-    if (drmIoctl(virgl->drm_fd, DRM_IOCTL_VIRTGPU_MAP, &virgl_map)) {
+    if (virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_MAP, &virgl_map)) {
 	xf86DrvMsg(virgl->pScrn->scrnIndex, X_ERROR,
                    "error doing VIRGL_MAP: %s\n", strerror(errno));
         return NULL;
@@ -601,11 +957,13 @@ static void virgl_bo_decref(virgl_screen_t *virgl, struct virgl_bo *_bo)
     if (bo->refcnt > 0)
 	return;
 
+    xorg_list_del(&bo->bos);
     munmap(bo->mapping, bo->size);
+    virgl->bo_bytes -= bo->size;
 
     /* just close the handle */
     args.handle = bo->handle;
-    ret = drmIoctl(virgl->drm_fd, DRM_IOCTL_GEM_CLOSE, &args);
+    ret = virgl_ioctl(virgl, DRM_IOCTL_GEM_CLOSE, &args);
     if (ret) {
         xf86DrvMsg(virgl->pScrn->scrnIndex, X_ERROR,
                    "error doing VIRGL_DECREF %d %d %d\n", ret, errno, bo->handle);
@@ -623,6 +981,73 @@ struct virgl_bo *virgl_bo_create_primary_resource(virgl_screen_t *virgl, uint32_
     return bo;
 }
 
+/*
+ * A one-row resource whose texels hold fill colours, so that all the
+ * colours of one depth share a single host resource and mapping.
+ */
+struct virgl_bo *virgl_bo_create_solid_slab(virgl_screen_t *virgl, int bpp)
+{
+    pixman_format_code_t pformat;
+    uint32_t format;
+    struct virgl_bo *bo;
+
+    virgl_get_formats(bpp, &pformat, &format);
+    if (!format)
+	return NULL;
+
+    bo = virgl_bo_alloc(virgl, 2, format, (1 << 1),
+			VIRGL_SOLID_SLAB_SIZE, 1, 0);
+    if (!bo)
+	return NULL;
+
+    if (!virgl_bo_map(bo)) {
+	virgl_bo_decref(virgl, bo);
+	return NULL;
+    }
+
+    return bo;
+}
+
+/* store a colour in texel x of a slab and upload just that texel */
+void virgl_bo_write_solid(virgl_screen_t *virgl, struct virgl_bo *_bo,
+			  int bpp, int x, Pixel pixel, Bool reused)
+{
+    struct virgl_kms_bo *bo = (struct virgl_kms_bo *)_bo;
+    struct drm_virtgpu_3d_box box;
+    int cpp = bpp / 8;
+    void *ptr;
+
+    if (reused) {
+	/* queued fills may still read the old colour, and the host may
+	 * not have fetched it from guest memory yet */
+	graw_flush_eq(virgl->gr_enc, NULL);
+	virgl_3d_wait(virgl, _bo);
+    }
+
+    ptr = (char *)bo->mapping + x * cpp;
+    switch (bpp) {
+    case 8:
+	*(uint8_t *)ptr = pixel;
+	break;
+    case 16:
+	*(uint16_t *)ptr = pixel;
+	break;
+    default:
+	*(uint32_t *)ptr = pixel;
+	break;
+    }
+
+    box.x = x;
+    box.y = 0;
+    box.z = 0;
+    box.w = 1;
+    box.h = 1;
+    box.d = 1;
+    virgl_3d_transfer_to_host(virgl, _bo, &box, VIRGL_SOLID_SLAB_SIZE * cpp,
+			      x * cpp, 0);
+    virgl_stats_transfer(virgl, FALSE, cpp);
+}
+
 struct virgl_bo *virgl_bo_create_argb_cursor_resource(virgl_screen_t *virgl,
 						      uint32_t width, uint32_t height)
 {
@@ -635,6 +1060,34 @@ struct virgl_bo *virgl_bo_create_argb_cursor_resource(virgl_screen_t *virgl,
     return bo;
 }
 
+/* store a cursor image in a cursor resource and upload all of it */
+void virgl_bo_write_cursor(virgl_screen_t *virgl, struct virgl_bo *_bo,
+			   const uint32_t *image, uint32_t width,
+			   uint32_t height, Bool reused)
+{
+    struct virgl_kms_bo *bo = (struct virgl_kms_bo *)_bo;
+    struct drm_virtgpu_3d_box box;
+    int stride = virgl_stride(width, 4);
+
+    if (reused) {
+	/* the host may not have fetched the previous image yet */
+	graw_flush_eq(virgl->gr_enc, NULL);
+	virgl_3d_wait(virgl, _bo);
+    }
+
+    virgl_copy_rows(bo->mapping, stride, (const uint8_t *)image, width * 4,
+		    width * 4, height);
+
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = width;
+    box.h = height;
+    box.d = 1;
+    virgl_3d_transfer_to_host(virgl, _bo, &box, stride, 0, 0);
+    virgl_stats_transfer(virgl, FALSE, stride * height);
+}
+
 static virgl_surface_t *
 virgl_kms_surface_create(virgl_screen_t *virgl,
 		       int width,
@@ -670,7 +1123,7 @@ virgl_kms_surface_create(virgl_screen_t *virgl,
     }
 
     virgl_get_formats (bpp, &pformat, &format);
-    stride = width * (bpp / 8);
+    stride = virgl_stride (width, bpp / 8);
 
     /* then fill out the driver surface */
     surface = calloc(1, sizeof *surface);
@@ -687,6 +1140,9 @@ virgl_kms_surface_create(virgl_screen_t *virgl,
 
     surface->host_image = pixman_image_create_bits (
 	pformat, width, height, ptr, stride);
+    xorg_list_init(&surface->lru);
+    xorg_list_init(&surface->migrate_link);
+    REGION_INIT (NULL, &surface->migrate_pending, (BoxPtr)NULL, 0);
     REGION_INIT (NULL, &(surface->access_region), (BoxPtr)NULL, 0);
     surface->access_type = UXA_ACCESS_RO;
 
@@ -697,6 +1153,13 @@ static void virgl_kms_surface_destroy(virgl_surface_t *surf)
 {
     virgl_screen_t *virgl = surf->virgl;
 
+    xorg_list_del(&surf->lru);
+    xorg_list_del(&surf->migrate_link);
+    REGION_UNINIT(NULL, &surf->migrate_pending);
+    if (surf->fb_id)
+	drmModeRmFB(virgl->drm_fd, surf->fb_id);
+    if (surf->migrate_image)
+	pixman_image_unref (surf->migrate_image);
     if (surf->bo)
         virgl_bo_decref(virgl, surf->bo);
     if (surf->host_image)
@@ -705,6 +1168,111 @@ static void virgl_kms_surface_destroy(virgl_surface_t *surf)
     free(surf);
 }
 
+static struct virgl_kms_bo *virgl_kms_bo_lookup(virgl_screen_t *virgl,
+						uint32_t handle)
+{
+    struct virgl_kms_bo *bo;
+
+    xorg_list_for_each_entry(bo, &virgl->kms_bos, bos) {
+	if (bo->handle == handle)
+	    return bo;
+    }
+    return NULL;
+}
+
+/*
+ * A surface over a buffer a DRI3 client allocated.  The layout is the
+ * client's, so the image uses its stride rather than ours.
+ *
+ * The kernel hands back the same GEM handle for a buffer we already
+ * hold, such as one of our own pixmaps exported earlier; that bo is
+ * shared rather than wrapped a second time, as closing the handle
+ * would pull it from under its first owner.
+ */
+virgl_surface_t *virgl_kms_surface_from_fd(virgl_screen_t *virgl, int fd,
+					   int width, int height, int depth,
+					   int stride)
+{
+    struct drm_virtgpu_resource_info info;
+    struct drm_gem_close args;
+    virgl_surface_t *surface;
+    struct virgl_kms_bo *bo;
+    pixman_format_code_t pformat;
+    uint32_t format;
+    uint32_t handle;
+    void *ptr;
+
+    virgl_get_formats(depth, &pformat, &format);
+    if (!format || stride < width * PIXMAN_FORMAT_BPP(pformat) / 8)
+	return NULL;
+
+    if (drmPrimeFDToHandle(virgl->drm_fd, fd, &handle))
+	return NULL;
+
+    bo = virgl_kms_bo_lookup(virgl, handle);
+    if (bo) {
+	if (bo->size < (uint64_t)stride * height)
+	    return NULL;
+	bo->refcnt++;
+    } else {
+	memset(&info, 0, sizeof(info));
+	info.bo_handle = handle;
+	if (virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info) ||
+	    info.size < (uint64_t)stride * height)
+	    goto err_close;
+
+	bo = calloc(1, sizeof(struct virgl_kms_bo));
+	if (!bo)
+	    goto err_close;
+
+	bo->size = info.size;
+	bo->handle = handle;
+	bo->res_handle = info.res_handle;
+	bo->virgl = virgl;
+	bo->refcnt = 1;
+	xorg_list_append(&bo->bos, &virgl->kms_bos);
+	virgl->bo_bytes += bo->size;
+    }
+
+    ptr = virgl_bo_map((struct virgl_bo *)bo);
+    surface = calloc(1, sizeof *surface);
+    if (!ptr || !surface) {
+	free(surface);
+	virgl_bo_decref(virgl, (struct virgl_bo *)bo);
+	return NULL;
+    }
+
+    surface->virgl = virgl;
+    surface->bo = (struct virgl_bo *)bo;
+    surface->host_image = pixman_image_create_bits(pformat, width, height,
+						   ptr, stride);
+    xorg_list_init(&surface->lru);
+    xorg_list_init(&surface->migrate_link);
+    REGION_INIT (NULL, &surface->migrate_pending, (BoxPtr)NULL, 0);
+    REGION_INIT (NULL, &(surface->access_region), (BoxPtr)NULL, 0);
+    surface->access_type = UXA_ACCESS_RO;
+
+    if (!surface->host_image) {
+	virgl_kms_surface_destroy(surface);
+	return NULL;
+    }
+
+    return surface;
+
+err_close:
+    args.handle = handle;
+    virgl_ioctl(virgl, DRM_IOCTL_GEM_CLOSE, &args);
+    return NULL;
+}
+
+int virgl_kms_bo_export_fd(struct virgl_bo *_bo, int *fd, uint32_t *size)
+{
+    struct virgl_kms_bo *bo = (struct virgl_kms_bo *)_bo;
+
+    *size = bo->size;
+    return drmPrimeHandleToFD(bo->virgl->drm_fd, bo->handle, DRM_CLOEXEC, fd);
+}
+
 struct virgl_bo_funcs virgl_kms_bo_funcs = {
     virgl_bo_map,
     virgl_bo_unmap,
@@ -744,7 +1312,7 @@ int virgl_kms_get_kernel_name(struct virgl_bo *_bo, uint32_t *name)
         return 0;
     }
     flink.handle = bo->handle;
-    r = drmIoctl(bo->virgl->drm_fd, DRM_IOCTL_GEM_FLINK, &flink);
+    r = virgl_ioctl(bo->virgl, DRM_IOCTL_GEM_FLINK, &flink);
     if (r) {
         return r;
     }
@@ -757,8 +1325,10 @@ int virgl_kms_3d_resource_migrate(struct virgl_surface_t *surf)
 {
     uint32_t format;
     pixman_format_code_t pformat;
-    void *ptr;
+    void *ptr = NULL;
     pixman_image_t *new_image;
+    int stride;
+    BoxRec box;
 
     int width, height;
 
@@ -766,29 +1336,211 @@ int virgl_kms_3d_resource_migrate(struct virgl_surface_t *surf)
     height = surf->pixmap->drawable.height;
     virgl_get_formats(surf->pixmap->drawable.bitsPerPixel, &pformat, &format);
 
-    surf->bo = virgl_bo_alloc(surf->virgl, 2, format, (1 << 1), width, height, 0);
+    surf->bo = NULL;
+    if (surf->virgl->has_blob) {
+	surf->bo = virgl_bo_alloc_blob(surf->virgl, format, (1 << 1),
+				       width, height, &stride);
+	if (surf->bo && !(ptr = virgl_bo_map(surf->bo))) {
+	    virgl_bo_decref(surf->virgl, surf->bo);
+	    surf->bo = NULL;
+	}
+    }
 
-    ptr = virgl_bo_map(surf->bo);
+    if (!surf->bo) {
+	stride = virgl_stride(width, virgl_format_cpp(format));
+	surf->bo = virgl_bo_alloc(surf->virgl, 2, format, (1 << 1), width, height, 0);
+	ptr = virgl_bo_map(surf->bo);
+    }
 
-    new_image = pixman_image_create_bits (pformat, width, height, ptr, pixman_image_get_stride(surf->host_image));
+    new_image = pixman_image_create_bits (pformat, width, height, ptr, stride);
 
     if (!new_image) {
 	ErrorF("failed to allocate new image\n");
 	return 0;
     }
-    pixman_image_composite (PIXMAN_OP_SRC,
-			    surf->host_image,
-			    NULL,
-			    new_image,
-			    0, 0, 0, 0, 0, 0, width, height);
-
 
-    pixman_image_unref(surf->host_image);
+    /* the contents follow later, see virgl_kms_migrate_region */
+    box.x1 = 0;
+    box.y1 = 0;
+    box.x2 = width;
+    box.y2 = height;
+    surf->migrate_image = surf->host_image;
     surf->host_image = new_image;
+    REGION_RESET(NULL, &surf->migrate_pending, &box);
+    xorg_list_append(&surf->migrate_link, &surf->virgl->migrating);
+
+    /* no longer needed once its DRI2 buffers are gone */
+    xorg_list_append(&surf->lru, &surf->virgl->surface_lru);
     return 0;
 }
 
-static int virgl_3d_transfer_to_host(int fd, struct virgl_bo *_bo,
+/*
+ * Lazy migration
+ *
+ * A migrated pixmap gets its resource at once, but its contents stay in
+ * the old system memory image until they are needed: before the host
+ * reads an area, before the CPU accesses one, or when the block handler
+ * gets round to it, VIRGL_MIGRATE_STEP bytes at a time.  Areas the host
+ * overwrites first are never uploaded at all, which is the common case
+ * for a DRI2 front buffer that receives a full swap right away.
+ */
+void virgl_kms_migrate_region(struct virgl_surface_t *surf, RegionPtr need)
+{
+    RegionRec todo;
+    BoxPtr boxes;
+    int n;
+
+    if (!surf->migrate_image)
+	return;
+
+    REGION_NULL(NULL, &todo);
+    if (need)
+	REGION_INTERSECT(NULL, &todo, &surf->migrate_pending, need);
+    else
+	REGION_COPY(NULL, &todo, &surf->migrate_pending);
+
+    n = REGION_NUM_RECTS(&todo);
+    boxes = REGION_RECTS(&todo);
+    while (n--) {
+	virgl_convert_image(surf->host_image, surf->migrate_image,
+			    boxes->x1, boxes->y1,
+			    boxes->x2 - boxes->x1, boxes->y2 - boxes->y1,
+			    TRUE);
+	virgl_kms_transfer_block(surf, boxes->x1, boxes->y1,
+				 boxes->x2, boxes->y2);
+	boxes++;
+    }
+
+    REGION_SUBTRACT(NULL, &surf->migrate_pending, &surf->migrate_pending,
+		    &todo);
+    REGION_UNINIT(NULL, &todo);
+
+    if (!REGION_NOTEMPTY(NULL, &surf->migrate_pending)) {
+	pixman_image_unref(surf->migrate_image);
+	surf->migrate_image = NULL;
+	xorg_list_del(&surf->migrate_link);
+    }
+}
+
+/* the host is about to read box */
+void virgl_kms_migrate_box(struct virgl_surface_t *surf, BoxPtr box)
+{
+    RegionRec need;
+
+    if (!surf->migrate_image)
+	return;
+
+    REGION_INIT(NULL, &need, box, 1);
+    virgl_kms_migrate_region(surf, &need);
+    REGION_UNINIT(NULL, &need);
+}
+
+/* the host is about to overwrite all of box */
+void virgl_kms_migrate_discard(struct virgl_surface_t *surf, BoxPtr box)
+{
+    RegionRec done;
+
+    if (!surf->migrate_image)
+	return;
+
+    REGION_INIT(NULL, &done, box, 1);
+    REGION_SUBTRACT(NULL, &surf->migrate_pending, &surf->migrate_pending,
+		    &done);
+    REGION_UNINIT(NULL, &done);
+
+    if (!REGION_NOTEMPTY(NULL, &surf->migrate_pending)) {
+	pixman_image_unref(surf->migrate_image);
+	surf->migrate_image = NULL;
+	xorg_list_del(&surf->migrate_link);
+    }
+}
+
+static void virgl_kms_migrate_step(virgl_screen_t *virgl)
+{
+    virgl_surface_t *surf, *tmp;
+    int budget = VIRGL_MIGRATE_STEP;
+
+    xorg_list_for_each_entry_safe(surf, tmp, &virgl->migrating,
+				  migrate_link) {
+	int cpp = (surf->pixmap->drawable.bitsPerPixel + 7) / 8;
+
+	while (budget > 0 && surf->migrate_image) {
+	    BoxRec band = *REGION_EXTENTS(NULL, &surf->migrate_pending);
+	    int width = band.x2 - band.x1;
+	    int rows = max(budget / (width * cpp), 1);
+
+	    band.y2 = min(band.y2, band.y1 + rows);
+	    virgl_kms_migrate_box(surf, &band);
+	    budget -= width * (band.y2 - band.y1) * cpp;
+	}
+	if (budget <= 0)
+	    break;
+    }
+}
+
+/*
+ * Memory budget
+ *
+ * Every resource counts towards bo_bytes.  With Option
+ * "VideoMemoryBudget" set, surfaces that can live in system memory just
+ * as well are moved back there, least recently used first, until the
+ * total is within budget again.  Those are the migrated pixmaps: the
+ * primary is scanned out and DRI2 buffers are shared with clients, and
+ * a migrated pixmap is skipped while a DRI2 buffer still names it, or
+ * once Present has flipped to it, as its framebuffer wraps the bo and may
+ * still be scanned out.
+ *
+ * Eviction runs from the block handler, where no pixmap is prepared for
+ * access, so the pixmap's data pointer can change under it.
+ */
+static Bool virgl_kms_surface_evict(virgl_surface_t *surf)
+{
+    virgl_screen_t *virgl = surf->virgl;
+    int width = surf->pixmap->drawable.width;
+    int height = surf->pixmap->drawable.height;
+    pixman_image_t *image;
+
+    /* not worth being clever about, the readback needs it all */
+    virgl_kms_migrate_region(surf, NULL);
+
+    image = pixman_image_create_bits(pixman_image_get_format(surf->host_image),
+				     width, height, NULL, 0);
+    if (!image)
+	return FALSE;
+
+    virgl_kms_transfer_get_block(surf, 0, 0, width, height);
+    virgl_convert_image(image, surf->host_image, 0, 0, width, height, FALSE);
+
+    pixman_image_unref(surf->host_image);
+    surf->host_image = image;
+    virgl_bo_decref(virgl, surf->bo);
+    surf->bo = NULL;
+    xorg_list_del(&surf->lru);
+
+    virgl->stats.evictions++;
+    return TRUE;
+}
+
+static void virgl_kms_enforce_budget(virgl_screen_t *virgl)
+{
+    virgl_surface_t *surf, *tmp;
+
+    if (!virgl->bo_budget || virgl->bo_bytes <= virgl->bo_budget)
+	return;
+
+    /* the readbacks must see every queued host operation */
+    graw_flush_eq(virgl->gr_enc, NULL);
+
+    xorg_list_for_each_entry_safe(surf, tmp, &virgl->surface_lru, lru) {
+	if (virgl->bo_bytes <= virgl->bo_budget)
+	    break;
+	if (surf->dri2_refs || surf->fb_id)
+	    continue;
+	virgl_kms_surface_evict(surf);
+    }
+}
+
+static int virgl_3d_transfer_to_host(virgl_screen_t *virgl, struct virgl_bo *_bo,
 				 struct drm_virtgpu_3d_box *transfer_box,
 				 uint32_t stride,
 				 uint32_t offset,
@@ -798,17 +1550,20 @@ static int virgl_3d_transfer_to_host(int fd, struct virgl_bo *_bo,
   struct virgl_kms_bo *bo = (struct virgl_kms_bo *)_bo;
   int ret;
 
+  memset(&putcmd, 0, sizeof(putcmd));
   putcmd.bo_handle = bo->handle;
   putcmd.box = *transfer_box;
   putcmd.level = level;
   putcmd.offset = offset;
-  //putcmd.stride = stride;
-  //putcmd.layer_stride = 0;
-  ret = drmIoctl(fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &putcmd);
+#ifdef HAVE_STRUCT_DRM_VIRTGPU_3D_TRANSFER_TO_HOST_STRIDE
+  putcmd.stride = stride;
+  putcmd.layer_stride = 0;
+#endif
+  ret = virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &putcmd);
   return ret;
 }
 
-static int virgl_3d_transfer_from_host(int fd, struct virgl_bo *_bo,
+static int virgl_3d_transfer_from_host(virgl_screen_t *virgl, struct virgl_bo *_bo,
 				 struct drm_virtgpu_3d_box *box,
 				 uint32_t stride,
 				 uint32_t dst_offset, uint32_t level)
@@ -817,18 +1572,21 @@ static int virgl_3d_transfer_from_host(int fd, struct virgl_bo *_bo,
   struct virgl_kms_bo *bo = (struct virgl_kms_bo *)_bo;
   int ret;
 
+  memset(&getcmd, 0, sizeof(getcmd));
   getcmd.bo_handle = bo->handle;
   getcmd.level = level;
   getcmd.box = *box;
   getcmd.offset = dst_offset;
-//  getcmd.stride = stride;
- // getcmd.layer_stride = 0;
-  ret = drmIoctl(fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &getcmd);
+#ifdef HAVE_STRUCT_DRM_VIRTGPU_3D_TRANSFER_TO_HOST_STRIDE
+  getcmd.stride = stride;
+  getcmd.layer_stride = 0;
+#endif
+  ret = virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &getcmd);
   return ret;
 }
 
 
-static int virgl_3d_wait(int fd, struct virgl_bo *_bo)
+static int virgl_3d_wait(virgl_screen_t *virgl, struct virgl_bo *_bo)
 {
   struct drm_virtgpu_3d_wait waitcmd;
   struct virgl_kms_bo *bo = _bo;
@@ -836,7 +1594,7 @@ static int virgl_3d_wait(int fd, struct virgl_bo *_bo)
 
   waitcmd.handle = bo->handle;
   waitcmd.flags = 0;
-  ret = drmIoctl(fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+  ret = virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
   return ret;
 }
 
@@ -844,7 +1602,7 @@ void virgl_kms_transfer_block(struct virgl_surface_t *surf,
 			      int x1, int y1, int x2, int y2)
 {
    int ret;
-   int fd = surf->virgl->drm_fd;
+   virgl_screen_t *virgl = surf->virgl;
    int size;
    void *ptr;
    int width = x2 - x1;
@@ -855,6 +1613,10 @@ void virgl_kms_transfer_block(struct virgl_surface_t *surf,
    int cpp = (surf->pixmap->drawable.bitsPerPixel + 7) / 8;
    uint32_t offset = (y1 * stride) + (x1 * cpp);
 
+   /* the host already sees what the CPU wrote */
+   if (((struct virgl_kms_bo *)surf->bo)->blob)
+      return;
+
    transfer_box.x = x1;
    transfer_box.y = y1;
    transfer_box.w = width;
@@ -862,8 +1624,9 @@ void virgl_kms_transfer_block(struct virgl_surface_t *surf,
    transfer_box.z = 0;
    transfer_box.d = 1;
 
-   ret = virgl_3d_transfer_to_host(fd, surf->bo,
+   ret = virgl_3d_transfer_to_host(virgl, surf->bo,
 			       &transfer_box, stride, offset, 0);
+   virgl_stats_transfer(virgl, FALSE, width * height * cpp);
 }
 
 
@@ -872,7 +1635,7 @@ void virgl_kms_transfer_get_block(struct virgl_surface_t *surf,
 {
 
    int ret;
-   int fd = surf->virgl->drm_fd;
+   virgl_screen_t *virgl = surf->virgl;
    int size;
    void *ptr;
    int width = x2 - x1;
@@ -884,6 +1647,11 @@ void virgl_kms_transfer_get_block(struct virgl_surface_t *surf,
    int stride = pixman_image_get_stride(surf->host_image);
    memset(&box, 0, sizeof(box));
 
+   if (((struct virgl_kms_bo *)surf->bo)->blob) {
+      virgl_blob_sync(virgl);
+      return;
+   }
+
    offset = y1 * stride + (x1 * cpp);
 
    box.x = x1;
@@ -893,12 +1661,325 @@ void virgl_kms_transfer_get_block(struct virgl_surface_t *surf,
    box.z = 0;
    box.d = 1;
 
-   ret = virgl_3d_transfer_from_host(fd, surf->bo, &box, stride, offset, 0);
+   ret = virgl_3d_transfer_from_host(virgl, surf->bo, &box, stride, offset, 0);
 
-   ret = virgl_3d_wait(fd, surf->bo);
+   ret = virgl_3d_wait(virgl, surf->bo);
+   virgl_stats_transfer(virgl, TRUE, width * height * cpp);
 }
 
-int virgl_execbuffer(int fd, uint32_t *block, int ndw)
+/*
+ * Staging uploads
+ *
+ * Instead of writing into the destination's own backing store and
+ * transferring it, image data is written into a ring of persistently
+ * mapped staging resources and the host copies it into place with
+ * RESOURCE_COPY_REGION.  The CPU never touches the destination, so it
+ * doesn't need to be read back or idle, and while the host works on one
+ * slot the CPU fills the next.
+ */
+static struct virgl_staging_slot *
+virgl_staging_get(virgl_screen_t *virgl, uint32_t format, int rows)
+{
+   struct virgl_staging_slot *slot = &virgl->staging[virgl->staging_cur];
+
+   if (slot->bo && slot->format == format &&
+       slot->used + rows <= VIRGL_STAGING_HEIGHT)
+      return slot;
+
+   if (slot->bo)
+      virgl->staging_cur = (virgl->staging_cur + 1) % VIRGL_STAGING_SLOTS;
+   slot = &virgl->staging[virgl->staging_cur];
+
+   /* queued copies must reach the host before the slot is rewritten */
+   if (slot->queued) {
+      graw_flush_eq(virgl->gr_enc, NULL);
+      slot->queued = FALSE;
+   }
+
+   if (slot->bo && slot->format != format) {
+      virgl_bo_decref(virgl, slot->bo);
+      slot->bo = NULL;
+   }
+
+   if (!slot->bo) {
+      slot->bo = virgl_bo_alloc(virgl, 2, format, (1 << 1),
+				VIRGL_STAGING_WIDTH, VIRGL_STAGING_HEIGHT, 0);
+      if (!slot->bo)
+	 return NULL;
+      if (!virgl_bo_map(slot->bo)) {
+	 virgl_bo_decref(virgl, slot->bo);
+	 slot->bo = NULL;
+	 return NULL;
+      }
+      slot->format = format;
+   } else {
+      /* only blocks when the host is still reading the last contents */
+      virgl_3d_wait(virgl, slot->bo);
+   }
+
+   slot->used = 0;
+   return slot;
+}
+
+Bool virgl_kms_upload(struct virgl_surface_t *surf, int x, int y, int w, int h,
+		      const char *src, int src_pitch)
+{
+   virgl_screen_t *virgl = surf->virgl;
+   int bpp = surf->pixmap->drawable.bitsPerPixel;
+   int cpp = bpp / 8;
+   int stride = VIRGL_STAGING_WIDTH * cpp;
+   pixman_format_code_t pformat;
+   uint32_t format;
+   int bx, by;
+
+   virgl_get_formats(bpp, &pformat, &format);
+   if (!format || !surf->bo)
+      return FALSE;
+
+   for (by = 0; by < h; by += VIRGL_STAGING_HEIGHT) {
+      int bh = min(h - by, VIRGL_STAGING_HEIGHT);
+
+      for (bx = 0; bx < w; bx += VIRGL_STAGING_WIDTH) {
+	 int bw = min(w - bx, VIRGL_STAGING_WIDTH);
+	 struct virgl_staging_slot *slot;
+	 struct drm_virtgpu_3d_box box;
+	 const char *s;
+	 char *d;
+
+	 slot = virgl_staging_get(virgl, format, bh);
+	 if (!slot)
+	    return FALSE;
+
+	 s = src + by * src_pitch + bx * cpp;
+	 d = (char *)((struct virgl_kms_bo *)slot->bo)->mapping +
+	    slot->used * stride;
+	 virgl_copy_rows((uint8_t *)d, stride, (const uint8_t *)s, src_pitch,
+			 bw * cpp, bh);
+
+	 box.x = 0;
+	 box.y = slot->used;
+	 box.z = 0;
+	 box.w = bw;
+	 box.h = bh;
+	 box.d = 1;
+	 virgl_3d_transfer_to_host(virgl, slot->bo, &box, stride,
+				   slot->used * stride, 0);
+	 virgl_stats_transfer(virgl, FALSE, bw * bh * cpp);
+
+	 graw_encode_resource_copy_region(virgl->gr_enc,
+					  virgl_kms_bo_get_res_handle(surf->bo),
+					  0, x + bx, y + by, 0,
+					  virgl_kms_bo_get_res_handle(slot->bo),
+					  0, &box);
+	 slot->queued = TRUE;
+	 slot->used += bh;
+      }
+   }
+
+   return TRUE;
+}
+
+/*
+ * Streaming readback
+ *
+ * Transfers from the host can only be waited for per resource, so a
+ * large readback straight into the pixmap is one long stall.  Here each
+ * band is copied on the host into a staging slot and transferred from
+ * there; the caller gets band N while the transfer of band N+1 is
+ * already in flight.
+ */
+void virgl_kms_readback_begin(struct virgl_readback *rb,
+			      struct virgl_surface_t *surf,
+			      int x1, int y1, int x2, int y2)
+{
+   rb->surf = surf;
+   rb->box.x1 = x1;
+   rb->box.y1 = y1;
+   rb->box.x2 = x2;
+   rb->box.y2 = y2;
+   rb->x = x1;
+   rb->y = y1;
+   rb->failed = FALSE;
+   rb->n_inflight = 0;
+
+   /* the copies below must see every queued host operation */
+   if (surf->virgl->gr_enc->buf_offset)
+      graw_flush_eq(surf->virgl->gr_enc, NULL);
+
+   /* a blob is read in place, as a single band */
+   if (((struct virgl_kms_bo *)surf->bo)->blob)
+      virgl_blob_sync(surf->virgl);
+}
+
+static Bool virgl_readback_issue(struct virgl_readback *rb)
+{
+   struct virgl_surface_t *surf = rb->surf;
+   virgl_screen_t *virgl = surf->virgl;
+   int bpp = surf->pixmap->drawable.bitsPerPixel;
+   int cpp = bpp / 8;
+   int stride = VIRGL_STAGING_WIDTH * cpp;
+   struct virgl_staging_slot *slot;
+   struct drm_virtgpu_3d_box sbox, tbox;
+   pixman_format_code_t pformat;
+   uint32_t format;
+   int w, h, n;
+
+   virgl_get_formats(bpp, &pformat, &format);
+   if (!format)
+      return FALSE;
+
+   w = min(rb->box.x2 - rb->x, VIRGL_STAGING_WIDTH);
+   h = min(rb->box.y2 - rb->y, VIRGL_READBACK_BAND);
+
+   /* every band gets a slot of its own: waiting for one band must not
+    * wait for the next one, which is still being copied out */
+   slot = virgl_staging_get(virgl, format, VIRGL_STAGING_HEIGHT);
+   if (!slot)
+      return FALSE;
+
+   sbox.x = rb->x;
+   sbox.y = rb->y;
+   sbox.z = 0;
+   sbox.w = w;
+   sbox.h = h;
+   sbox.d = 1;
+   graw_encode_resource_copy_region(virgl->gr_enc,
+				    virgl_kms_bo_get_res_handle(slot->bo),
+				    0, 0, slot->used, 0,
+				    virgl_kms_bo_get_res_handle(surf->bo),
+				    0, &sbox);
+   graw_flush_eq(virgl->gr_enc, NULL);
+   slot->queued = FALSE;
+
+   tbox.x = 0;
+   tbox.y = slot->used;
+   tbox.z = 0;
+   tbox.w = w;
+   tbox.h = h;
+   tbox.d = 1;
+   virgl_3d_transfer_from_host(virgl, slot->bo, &tbox, stride,
+			       slot->used * stride, 0);
+   virgl_stats_transfer(virgl, TRUE, w * h * cpp);
+
+   n = rb->n_inflight++;
+   rb->inflight[n].box.x1 = rb->x;
+   rb->inflight[n].box.y1 = rb->y;
+   rb->inflight[n].box.x2 = rb->x + w;
+   rb->inflight[n].box.y2 = rb->y + h;
+   rb->inflight[n].slot = slot - virgl->staging;
+   rb->inflight[n].row = slot->used;
+   slot->used += h;
+
+   rb->x += w;
+   if (rb->x >= rb->box.x2) {
+      rb->x = rb->box.x1;
+      rb->y += h;
+   }
+   return TRUE;
+}
+
+/* FALSE once the whole box has been returned, or on failure */
+Bool virgl_kms_readback_next(struct virgl_readback *rb, BoxPtr band,
+			     const char **data, int *pitch)
+{
+   virgl_screen_t *virgl = rb->surf->virgl;
+   int cpp = rb->surf->pixmap->drawable.bitsPerPixel / 8;
+   struct virgl_staging_slot *slot;
+   int i;
+
+   if (rb->failed)
+      return FALSE;
+
+   if (((struct virgl_kms_bo *)rb->surf->bo)->blob) {
+      int stride = pixman_image_get_stride(rb->surf->host_image);
+
+      if (rb->y >= rb->box.y2)
+	 return FALSE;
+
+      *band = rb->box;
+      *pitch = stride;
+      *data = (const char *)pixman_image_get_data(rb->surf->host_image) +
+	 rb->box.y1 * stride + rb->box.x1 * cpp;
+      rb->y = rb->box.y2;
+      return TRUE;
+   }
+
+   while (rb->n_inflight < VIRGL_READBACK_DEPTH && rb->y < rb->box.y2) {
+      if (!virgl_readback_issue(rb)) {
+	 rb->failed = TRUE;
+	 return FALSE;
+      }
+   }
+
+   if (!rb->n_inflight)
+      return FALSE;
+
+   slot = &virgl->staging[rb->inflight[0].slot];
+   virgl_3d_wait(virgl, slot->bo);
+
+   *band = rb->inflight[0].box;
+   *pitch = VIRGL_STAGING_WIDTH * cpp;
+   *data = (const char *)((struct virgl_kms_bo *)slot->bo)->mapping +
+      rb->inflight[0].row * *pitch;
+
+   rb->n_inflight--;
+   for (i = 0; i < rb->n_inflight; i++)
+      rb->inflight[i] = rb->inflight[i + 1];
+
+   return TRUE;
+}
+
+/*
+ * Readback into the pixmap's own storage: every box is requested up
+ * front and waited for once, instead of one round trip per box.
+ */
+void virgl_kms_transfer_get_boxes(struct virgl_surface_t *surf,
+				  const BoxRec *boxes, int n_boxes)
+{
+   virgl_screen_t *virgl = surf->virgl;
+   int cpp = (surf->pixmap->drawable.bitsPerPixel + 7) / 8;
+   int stride = pixman_image_get_stride(surf->host_image);
+   struct drm_virtgpu_3d_box box;
+   int i;
+
+   if (!n_boxes)
+      return;
+
+   if (((struct virgl_kms_bo *)surf->bo)->blob) {
+      virgl_blob_sync(virgl);
+      return;
+   }
+
+   for (i = 0; i < n_boxes; i++) {
+      box.x = boxes[i].x1;
+      box.y = boxes[i].y1;
+      box.z = 0;
+      box.w = boxes[i].x2 - boxes[i].x1;
+      box.h = boxes[i].y2 - boxes[i].y1;
+      box.d = 1;
+
+      virgl_3d_transfer_from_host(virgl, surf->bo, &box, stride,
+				  box.y * stride + box.x * cpp, 0);
+      virgl_stats_transfer(virgl, TRUE, box.w * box.h * cpp);
+   }
+
+   virgl_3d_wait(virgl, surf->bo);
+}
+
+void virgl_kms_staging_fini(virgl_screen_t *virgl)
+{
+   int i;
+
+   for (i = 0; i < VIRGL_STAGING_SLOTS; i++) {
+      if (virgl->staging[i].bo)
+	 virgl_bo_decref(virgl, virgl->staging[i].bo);
+      virgl->staging[i].bo = NULL;
+      virgl->staging[i].queued = FALSE;
+   }
+   virgl->staging_cur = 0;
+}
+
+int virgl_execbuffer(virgl_screen_t *virgl, uint32_t *block, int ndw)
 {
    struct drm_virtgpu_execbuffer eb;
    int ret;
@@ -910,7 +1991,9 @@ int virgl_execbuffer(int fd, uint32_t *block, int ndw)
    eb.flags = 0;
    eb.command = (unsigned long)(void *)block;
    eb.size = ndw * 4;
-   ret = drmIoctl(fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &eb);
+   ret = virgl_ioctl(virgl, DRM_IOCTL_VIRTGPU_EXECBUFFER, &eb);
+   if (virgl->has_blob)
+      virgl->blob_pending = TRUE;
    return ret;
 }
 
@@ -982,12 +2065,23 @@ int graw_encode_resource_copy_region(struct graw_encoder_state *enc,
 int graw_encode_blit(struct graw_encoder_state *enc,
                      uint32_t dst_handle, uint32_t src_handle,
 		     struct drm_virtgpu_3d_box *dbox,
-		     struct drm_virtgpu_3d_box *sbox)
+		     struct drm_virtgpu_3d_box *sbox,
+		     unsigned filter, const BoxRec *scissor)
 {
+   uint32_t s0 = 0xf | (filter << 8);
+
+   if (scissor)
+      s0 |= GRAW_BLIT_SCISSOR_ENABLE;
+
    graw_encoder_write_cmd_dword(enc, GRAW_CMD0(GRAW_BLIT, 0, 21));
-   graw_encoder_write_dword(enc, 0xf);
-   graw_encoder_write_dword(enc, 0);
-   graw_encoder_write_dword(enc, 0);
+   graw_encoder_write_dword(enc, s0);
+   if (scissor) {
+      graw_encoder_write_dword(enc, scissor->x1 | (scissor->y1 << 16));
+      graw_encoder_write_dword(enc, scissor->x2 | (scissor->y2 << 16));
+   } else {
+      graw_encoder_write_dword(enc, 0);
+      graw_encoder_write_dword(enc, 0);
+   }
 
    graw_encoder_write_dword(enc, dst_handle);
    graw_encoder_write_dword(enc, 0); // level
@@ -1014,13 +2108,13 @@ int graw_encode_blit(struct graw_encoder_state *enc,
 static void graw_flush_eq(struct graw_encoder_state *eq, void *closure)
 {
    /* send the buffer to the remote side for decoding - for now jdi */
-   virgl_execbuffer(eq->fd, eq->buf, eq->buf_offset);
+   virgl_execbuffer(eq->closure, eq->buf, eq->buf_offset);
    eq->buf_offset = 0;
 }
 
 #define EQ_BUF_SIZE (16*1024)
 
-struct graw_encoder_state *graw_encoder_init_queue(int fd)
+struct graw_encoder_state *graw_encoder_init_queue(virgl_screen_t *virgl)
 {
    struct graw_encoder_state *eq;
 
@@ -1035,7 +2129,8 @@ struct graw_encoder_state *graw_encoder_init_queue(int fd)
    }
    eq->buf_total = EQ_BUF_SIZE;
    eq->buf_offset = 0;
-   eq->fd = fd;
+   eq->flush = graw_flush_eq;
+   eq->closure = virgl;
    return eq;
 }
 
@@ -1095,7 +2190,7 @@ static PciChipsets virglPciChips[] = {
 static const OptionInfoRec *
 virgl_available_options (int chipid, int busid)
 {
-  return NULL;
+    return DefaultOptions;
 }
 
 static void
@@ -1115,6 +2210,7 @@ virgl_init_scrn (ScrnInfoPtr pScrn)
     pScrn->ScreenInit       = virgl_screen_init_kms;
     pScrn->EnterVT          = virgl_enter_vt_kms;
     pScrn->LeaveVT          = virgl_leave_vt_kms;
+    pScrn->FreeScreen       = virgl_free_screen_kms;
 
     pScrn->SwitchMode       = virgl_switch_mode;
     pScrn->ValidMode        = NULL;
@@ -0,0 +1,423 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Present
+ *
+ * virtio-gpu has no vertical blank interrupt, so the MSC of a CRTC is
+ * derived from the clock and its mode's refresh rate, and vblank events
+ * are server timers.  Copies are done by Present itself through UXA.
+ *
+ * A full-screen window whose pixmap has a resource can be flipped to:
+ * the resource gets a framebuffer of its own and is page-flipped onto
+ * every enabled CRTC, and flipping back puts the primary up again.
+ * Flips complete from the DRM event handler, see virgl_drmmode.c.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xorg-server.h"
+#include "virgl.h"
+
+#ifdef PRESENT
+
+#include "present.h"
+
+struct virgl_vblank {
+    struct xorg_list link;
+    xf86CrtcPtr crtc;
+    uint64_t event_id;
+    uint64_t msc;
+    OsTimerPtr timer;
+};
+
+static uint64_t
+virgl_present_frame_us (xf86CrtcPtr crtc)
+{
+    float refresh = xf86ModeVRefresh (&crtc->mode);
+
+    if (refresh < 1)
+	refresh = 60;
+    return 1000000 / refresh;
+}
+
+static void
+virgl_present_ust_msc (xf86CrtcPtr crtc, uint64_t *ust, uint64_t *msc)
+{
+    *ust = GetTimeInMicros ();
+    *msc = *ust / virgl_present_frame_us (crtc);
+}
+
+/* the enabled CRTC showing most of the window */
+static RRCrtcPtr
+virgl_present_get_crtc (WindowPtr window)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn (window->drawable.pScreen);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR (scrn);
+    xf86CrtcPtr best = NULL;
+    int best_area = 0;
+    BoxRec win;
+    int i;
+
+    win.x1 = window->drawable.x;
+    win.y1 = window->drawable.y;
+    win.x2 = win.x1 + window->drawable.width;
+    win.y2 = win.y1 + window->drawable.height;
+
+    for (i = 0; i < config->num_crtc; i++)
+    {
+	xf86CrtcPtr crtc = config->crtc[i];
+	int w, h;
+
+	if (!crtc->enabled)
+	    continue;
+
+	w = min (win.x2, crtc->x + crtc->mode.HDisplay) - max (win.x1, crtc->x);
+	h = min (win.y2, crtc->y + crtc->mode.VDisplay) - max (win.y1, crtc->y);
+	if (w > 0 && h > 0 && w * h > best_area)
+	{
+	    best = crtc;
+	    best_area = w * h;
+	}
+    }
+
+    return best ? best->randr_crtc : NULL;
+}
+
+static int
+virgl_present_get_ust_msc (RRCrtcPtr rrcrtc, CARD64 *ust, CARD64 *msc)
+{
+    uint64_t u, m;
+
+    virgl_present_ust_msc (rrcrtc->devPrivate, &u, &m);
+    *ust = u;
+    *msc = m;
+    return Success;
+}
+
+static CARD32
+virgl_present_vblank_timer (OsTimerPtr timer, CARD32 now, void *arg)
+{
+    struct virgl_vblank *vblank = arg;
+    uint64_t ust, msc;
+
+    virgl_present_ust_msc (vblank->crtc, &ust, &msc);
+    if (msc < vblank->msc)
+	return max ((vblank->msc * virgl_present_frame_us (vblank->crtc) -
+		     ust) / 1000, 1);
+
+    present_event_notify (vblank->event_id, ust, msc);
+    xorg_list_del (&vblank->link);
+    TimerFree (vblank->timer);
+    free (vblank);
+    return 0;
+}
+
+static int
+virgl_present_queue_vblank (RRCrtcPtr rrcrtc, uint64_t event_id, uint64_t msc)
+{
+    xf86CrtcPtr crtc = rrcrtc->devPrivate;
+    virgl_screen_t *virgl = crtc->scrn->driverPrivate;
+    struct virgl_vblank *vblank;
+    uint64_t ust, now;
+
+    vblank = calloc (1, sizeof (*vblank));
+    if (!vblank)
+	return BadAlloc;
+
+    vblank->crtc = crtc;
+    vblank->event_id = event_id;
+    vblank->msc = msc;
+
+    virgl_present_ust_msc (crtc, &ust, &now);
+    vblank->timer = TimerSet (NULL, 0,
+			      msc > now ? (msc * virgl_present_frame_us (crtc)
+					   - ust) / 1000 + 1 : 1,
+			      virgl_present_vblank_timer, vblank);
+    if (!vblank->timer)
+    {
+	free (vblank);
+	return BadAlloc;
+    }
+
+    xorg_list_add (&vblank->link, &virgl->present_vblanks);
+    return Success;
+}
+
+static void
+virgl_present_abort_vblank (RRCrtcPtr rrcrtc, uint64_t event_id, uint64_t msc)
+{
+    xf86CrtcPtr crtc = rrcrtc->devPrivate;
+    virgl_screen_t *virgl = crtc->scrn->driverPrivate;
+    struct virgl_vblank *vblank, *tmp;
+
+    xorg_list_for_each_entry_safe (vblank, tmp, &virgl->present_vblanks, link)
+    {
+	if (vblank->event_id == event_id)
+	{
+	    xorg_list_del (&vblank->link);
+	    TimerFree (vblank->timer);
+	    free (vblank);
+	    break;
+	}
+    }
+}
+
+static void
+virgl_present_flush (WindowPtr window)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn (window->drawable.pScreen);
+
+    virgl_flush (scrn->driverPrivate);
+}
+
+/*
+ * Flips
+ *
+ * A flip is queued on every enabled CRTC and Present is told once the
+ * last of them has completed, from the DRM event handler.
+ */
+struct virgl_flip {
+    xf86CrtcPtr crtc;		/* the MSC reported is this one's */
+    uint64_t event_id;
+    int pending;
+};
+
+static void
+virgl_present_flip_handler (uint64_t frame, uint64_t usec, void *data)
+{
+    struct virgl_flip *flip = data;
+    uint64_t ust, msc;
+
+    if (--flip->pending)
+	return;
+
+    virgl_present_ust_msc (flip->crtc, &ust, &msc);
+    present_event_notify (flip->event_id, usec, msc);
+    free (flip);
+}
+
+static void
+virgl_present_flip_abort (void *data)
+{
+    struct virgl_flip *flip = data;
+
+    if (--flip->pending == 0)
+	free (flip);
+}
+
+/* flip every enabled CRTC to fb_id; FALSE if none could be */
+static Bool
+virgl_present_flip_all (virgl_screen_t *virgl, xf86CrtcPtr crtc,
+			uint32_t fb_id, uint64_t event_id)
+{
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR (virgl->pScrn);
+    struct virgl_flip *flip;
+    int i;
+
+    flip = calloc (1, sizeof (*flip));
+    if (!flip)
+	return FALSE;
+
+    flip->crtc = crtc;
+    flip->event_id = event_id;
+
+    /* held until every flip is queued so an early event can't free it */
+    flip->pending = 1;
+
+    for (i = 0; i < config->num_crtc; i++)
+    {
+	drmmode_crtc_private_ptr drmmode_crtc = config->crtc[i]->driver_private;
+	uint32_t seq;
+
+	if (!config->crtc[i]->enabled)
+	    continue;
+
+	seq = drmmode_event_queue (&virgl->drmmode, flip,
+				   virgl_present_flip_handler,
+				   virgl_present_flip_abort);
+	if (!seq)
+	    continue;
+
+	if (drmModePageFlip (virgl->drm_fd, drmmode_crtc->mode_crtc->crtc_id,
+			     fb_id, DRM_MODE_PAGE_FLIP_EVENT,
+			     (void *)(uintptr_t)seq))
+	{
+	    drmmode_event_cancel (seq);
+	    continue;
+	}
+	flip->pending++;
+    }
+
+    if (flip->pending == 1)
+    {
+	free (flip);
+	return FALSE;
+    }
+
+    flip->pending--;
+    return TRUE;
+}
+
+static Bool
+virgl_present_check_flip (RRCrtcPtr rrcrtc, WindowPtr window,
+			  PixmapPtr pixmap, Bool sync_flip)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn (window->drawable.pScreen);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR (scrn);
+    virgl_surface_t *surface = get_surface (pixmap);
+    int i;
+
+    if (!scrn->vtSema || !surface || !surface->bo)
+	return FALSE;
+
+    if (pixmap->drawable.width != scrn->virtualX ||
+	pixmap->drawable.height != scrn->virtualY ||
+	pixmap->drawable.bitsPerPixel != scrn->bitsPerPixel)
+	return FALSE;
+
+    for (i = 0; i < config->num_crtc; i++)
+    {
+	if (config->crtc[i]->enabled &&
+	    config->crtc[i]->rotation != RR_Rotate_0)
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+static Bool
+virgl_present_flip (RRCrtcPtr rrcrtc, uint64_t event_id, uint64_t target_msc,
+		    PixmapPtr pixmap, Bool sync_flip)
+{
+    xf86CrtcPtr crtc = rrcrtc->devPrivate;
+    virgl_screen_t *virgl = crtc->scrn->driverPrivate;
+    virgl_surface_t *surface = get_surface (pixmap);
+
+    virgl_kms_migrate_region (surface, NULL);
+
+    if (!surface->fb_id &&
+	drmModeAddFB (virgl->drm_fd,
+		      pixmap->drawable.width, pixmap->drawable.height,
+		      pixmap->drawable.depth, pixmap->drawable.bitsPerPixel,
+		      pixman_image_get_stride (surface->host_image),
+		      virgl_kms_bo_get_handle (surface->bo),
+		      &surface->fb_id))
+    {
+	surface->fb_id = 0;
+	return FALSE;
+    }
+
+    /* the host must have the frame before it is scanned out */
+    virgl_flush_sync (virgl);
+
+    return virgl_present_flip_all (virgl, crtc, surface->fb_id, event_id);
+}
+
+static void
+virgl_present_unflip (ScreenPtr screen, uint64_t event_id)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn (screen);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR (scrn);
+    virgl_screen_t *virgl = scrn->driverPrivate;
+    xf86CrtcPtr crtc = NULL;
+    uint64_t ust, msc;
+    int i;
+
+    for (i = 0; i < config->num_crtc; i++)
+    {
+	if (config->crtc[i]->enabled)
+	{
+	    crtc = config->crtc[i];
+	    break;
+	}
+    }
+
+    virgl_flush_sync (virgl);
+
+    if (crtc && virgl_present_flip_all (virgl, crtc, virgl->drmmode.fb_id,
+					event_id))
+	return;
+
+    /* no flip to wait for, the modeset is done when it returns */
+    xf86SetDesiredModes (scrn);
+
+    if (crtc)
+	virgl_present_ust_msc (crtc, &ust, &msc);
+    else
+    {
+	ust = GetTimeInMicros ();
+	msc = 0;
+    }
+    present_event_notify (event_id, ust, msc);
+}
+
+static present_screen_info_rec virgl_present_info = {
+    .version = PRESENT_SCREEN_INFO_VERSION,
+
+    .get_crtc = virgl_present_get_crtc,
+    .get_ust_msc = virgl_present_get_ust_msc,
+    .queue_vblank = virgl_present_queue_vblank,
+    .abort_vblank = virgl_present_abort_vblank,
+    .flush = virgl_present_flush,
+
+    .capabilities = PresentCapabilityNone,
+    .check_flip = virgl_present_check_flip,
+    .flip = virgl_present_flip,
+    .unflip = virgl_present_unflip,
+};
+
+Bool
+virgl_present_init (ScreenPtr screen)
+{
+    return present_screen_init (screen, &virgl_present_info);
+}
+
+void
+virgl_present_fini (ScreenPtr screen)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn (screen);
+    virgl_screen_t *virgl = scrn->driverPrivate;
+    struct virgl_vblank *vblank, *tmp;
+
+    xorg_list_for_each_entry_safe (vblank, tmp, &virgl->present_vblanks, link)
+    {
+	xorg_list_del (&vblank->link);
+	TimerFree (vblank->timer);
+	free (vblank);
+    }
+}
+
+#else /* !PRESENT */
+
+Bool
+virgl_present_init (ScreenPtr screen)
+{
+    return FALSE;
+}
+
+void
+virgl_present_fini (ScreenPtr screen)
+{
+}
+
+#endif
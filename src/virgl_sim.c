@@ -0,0 +1,568 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Simulated virtio-gpu 3D device.
+ *
+ * With Option "SimulateDevice" the virtio-gpu specific ioctls are
+ * answered here instead of by the kernel, so the driver can run on any
+ * KMS device that supports dumb buffers (vkms for instance).  Guest
+ * backing storage is a dumb buffer on the real fd, so mapping, scanout
+ * and cursors keep working; the host side of every resource lives in
+ * malloc'ed memory and the command stream is decoded in software.
+ *
+ * Option "SimulateLatency" adds a delay to every simulated ioctl, either
+ * one value in microseconds for all of them or a list like
+ * "execbuffer=50,transfer_from_host=400".
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "virgl.h"
+
+/* graw commands understood by the decoder */
+#define SIM_CMD_CLEAR			7
+#define SIM_CMD_BLIT			16
+#define SIM_CMD_RESOURCE_COPY_REGION	17
+
+#ifdef HAVE_STRUCT_DRM_VIRTGPU_3D_TRANSFER_TO_HOST_STRIDE
+#define SIM_XFER_STRIDE(xfer) ((xfer)->stride)
+#else
+#define SIM_XFER_STRIDE(xfer) 0
+#endif
+
+struct sim_resource {
+    struct xorg_list link;
+    uint32_t handle;		/* gem handle of the guest backing */
+    uint32_t res_handle;
+    int width;
+    int height;
+    int cpp;
+    int stride;
+    uint64_t size;
+    uint64_t map_offset;
+    uint8_t *guest;
+    uint8_t *host;
+};
+
+struct virgl_sim {
+    int fd;
+    uint32_t next_res_handle;
+    struct xorg_list resources;
+    unsigned int latency[VIRGL_STAT_NUM_IOCTLS];
+};
+
+static int
+sim_format_cpp (uint32_t format)
+{
+    switch (format)
+    {
+    case VIRGL_FORMAT_A8_UNORM:
+	return 1;
+    case VIRGL_FORMAT_B5G6R5_UNORM:
+	return 2;
+    default:
+	return 4;
+    }
+}
+
+static struct sim_resource *
+sim_lookup_handle (struct virgl_sim *sim, uint32_t handle)
+{
+    struct sim_resource *res;
+
+    xorg_list_for_each_entry (res, &sim->resources, link)
+    {
+	if (res->handle == handle)
+	    return res;
+    }
+    return NULL;
+}
+
+static struct sim_resource *
+sim_lookup_res (struct virgl_sim *sim, uint32_t res_handle)
+{
+    struct sim_resource *res;
+
+    xorg_list_for_each_entry (res, &sim->resources, link)
+    {
+	if (res->res_handle == res_handle)
+	    return res;
+    }
+    return NULL;
+}
+
+static uint8_t *
+sim_guest_map (struct virgl_sim *sim, struct sim_resource *res)
+{
+    struct drm_mode_map_dumb map;
+    void *ptr;
+
+    if (res->guest)
+	return res->guest;
+
+    memset (&map, 0, sizeof (map));
+    map.handle = res->handle;
+    if (drmIoctl (sim->fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+	return NULL;
+
+    ptr = mmap (0, res->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		sim->fd, map.offset);
+    if (ptr == MAP_FAILED)
+	return NULL;
+
+    res->map_offset = map.offset;
+    res->guest = ptr;
+    return res->guest;
+}
+
+static int
+sim_resource_create (struct virgl_sim *sim,
+		     struct drm_virtgpu_resource_create *create)
+{
+    struct drm_mode_create_dumb dumb;
+    struct drm_mode_destroy_dumb destroy;
+    struct sim_resource *res;
+    int cpp = sim_format_cpp (create->format);
+    int stride = (create->width * cpp + 3) & ~3;
+
+    if (create->stride > stride && !(create->stride & 3))
+	stride = create->stride;
+
+    /* allocate the guest side as 32bpp so the pitch matches ours */
+    memset (&dumb, 0, sizeof (dumb));
+    dumb.width = stride / 4;
+    dumb.height = create->height;
+    dumb.bpp = 32;
+    if (drmIoctl (sim->fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb))
+	return -errno;
+
+    if (dumb.pitch != stride)
+	goto err_destroy;
+
+    res = calloc (1, sizeof (*res));
+    if (!res)
+	goto err_destroy;
+
+    res->host = calloc (create->height, stride);
+    if (!res->host)
+    {
+	free (res);
+	goto err_destroy;
+    }
+
+    res->handle = dumb.handle;
+    res->res_handle = ++sim->next_res_handle;
+    res->width = create->width;
+    res->height = create->height;
+    res->cpp = cpp;
+    res->stride = stride;
+    res->size = dumb.size;
+    xorg_list_add (&res->link, &sim->resources);
+
+    create->bo_handle = res->handle;
+    create->res_handle = res->res_handle;
+    return 0;
+
+err_destroy:
+    destroy.handle = dumb.handle;
+    drmIoctl (sim->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    return -ENOMEM;
+}
+
+static void
+sim_resource_destroy (struct sim_resource *res)
+{
+    xorg_list_del (&res->link);
+    if (res->guest)
+	munmap (res->guest, res->size);
+    free (res->host);
+    free (res);
+}
+
+static Bool
+sim_clip_box (struct sim_resource *res, struct drm_virtgpu_3d_box *box)
+{
+    return box->w && box->h &&
+	box->x + box->w <= res->width && box->y + box->h <= res->height;
+}
+
+static int
+sim_transfer (struct virgl_sim *sim, uint32_t handle,
+	      struct drm_virtgpu_3d_box *box, uint32_t offset,
+	      uint32_t stride, Bool to_host)
+{
+    struct sim_resource *res = sim_lookup_handle (sim, handle);
+    uint8_t *guest;
+    int y;
+
+    if (!res || !sim_clip_box (res, box))
+	return -EINVAL;
+
+    guest = sim_guest_map (sim, res);
+    if (!guest)
+	return -ENOMEM;
+
+    /* like the host, a stride of 0 means the resource's own */
+    if (!stride)
+	stride = res->stride;
+
+    if (offset + (uint64_t)(box->h - 1) * stride +
+	box->w * res->cpp > res->size)
+	return -EINVAL;
+
+    for (y = 0; y < box->h; y++)
+    {
+	uint8_t *g = guest + offset + y * stride;
+	uint8_t *h = res->host + (box->y + y) * res->stride + box->x * res->cpp;
+
+	if (to_host)
+	    memcpy (h, g, box->w * res->cpp);
+	else
+	    memcpy (g, h, box->w * res->cpp);
+    }
+    return 0;
+}
+
+/*
+ * Nearest-neighbour blit between host images; the source is staged when
+ * it aliases the destination so overlapping blits behave like the host.
+ * Only destination pixels inside the scissor, if any, are written.
+ */
+static void
+sim_blit (struct sim_resource *dst, struct drm_virtgpu_3d_box *dbox,
+	  struct sim_resource *src, struct drm_virtgpu_3d_box *sbox,
+	  const BoxRec *scissor)
+{
+    uint8_t *sbits = src->host;
+    int sstride = src->stride;
+    int cpp = dst->cpp;
+    int x, y, x1, y1, x2, y2;
+
+    if (src->cpp != dst->cpp ||
+	!sim_clip_box (dst, dbox) || !sim_clip_box (src, sbox))
+	return;
+
+    x1 = 0;
+    y1 = 0;
+    x2 = dbox->w;
+    y2 = dbox->h;
+    if (scissor)
+    {
+	x1 = max (x1, scissor->x1 - (int)dbox->x);
+	y1 = max (y1, scissor->y1 - (int)dbox->y);
+	x2 = min (x2, scissor->x2 - (int)dbox->x);
+	y2 = min (y2, scissor->y2 - (int)dbox->y);
+	if (x1 >= x2 || y1 >= y2)
+	    return;
+    }
+
+    if (src == dst)
+    {
+	sstride = sbox->w * cpp;
+	sbits = malloc ((size_t)sstride * sbox->h);
+	if (!sbits)
+	    return;
+	for (y = 0; y < sbox->h; y++)
+	    memcpy (sbits + y * sstride,
+		    src->host + (sbox->y + y) * src->stride + sbox->x * cpp,
+		    sstride);
+    }
+    else
+    {
+	sbits += sbox->y * sstride + sbox->x * cpp;
+    }
+
+    for (y = y1; y < y2; y++)
+    {
+	uint8_t *d = dst->host + (dbox->y + y) * dst->stride + dbox->x * cpp;
+	uint8_t *s = sbits + (y * sbox->h / dbox->h) * sstride;
+
+	if (sbox->w == dbox->w)
+	{
+	    memcpy (d + x1 * cpp, s + x1 * cpp, (x2 - x1) * cpp);
+	    continue;
+	}
+	for (x = x1; x < x2; x++)
+	    memcpy (d + x * cpp, s + (x * sbox->w / dbox->w) * cpp, cpp);
+    }
+
+    if (src == dst)
+	free (sbits);
+}
+
+static void
+sim_read_box (const uint32_t *p, struct drm_virtgpu_3d_box *box)
+{
+    box->x = p[0];
+    box->y = p[1];
+    box->z = p[2];
+    box->w = p[3];
+    box->h = p[4];
+    box->d = p[5];
+}
+
+static int
+sim_execbuffer (virgl_screen_t *virgl, struct drm_virtgpu_execbuffer *eb)
+{
+    struct virgl_sim *sim = virgl->sim;
+    const uint32_t *cmd = (const uint32_t *)(uintptr_t)eb->command;
+    uint32_t ndw = eb->size / 4;
+    uint32_t i = 0;
+
+    while (i < ndw)
+    {
+	uint32_t op = cmd[i] & 0xff;
+	uint32_t len = cmd[i] >> 16;
+	const uint32_t *p = cmd + i + 1;
+	struct drm_virtgpu_3d_box dbox, sbox;
+	struct sim_resource *dst, *src;
+	BoxRec scissor;
+
+	if (i + 1 + len > ndw)
+	    return -EINVAL;
+
+	switch (op)
+	{
+	case SIM_CMD_BLIT:
+	    if (len < 21)
+		return -EINVAL;
+	    dst = sim_lookup_res (sim, p[3]);
+	    src = sim_lookup_res (sim, p[12]);
+	    if (!dst || !src)
+		return -EINVAL;
+	    sim_read_box (p + 6, &dbox);
+	    sim_read_box (p + 15, &sbox);
+	    if (p[0] & GRAW_BLIT_SCISSOR_ENABLE)
+	    {
+		scissor.x1 = p[1] & 0xffff;
+		scissor.y1 = p[1] >> 16;
+		scissor.x2 = p[2] & 0xffff;
+		scissor.y2 = p[2] >> 16;
+		sim_blit (dst, &dbox, src, &sbox, &scissor);
+	    }
+	    else
+		sim_blit (dst, &dbox, src, &sbox, NULL);
+	    break;
+
+	case SIM_CMD_RESOURCE_COPY_REGION:
+	    if (len < 13)
+		return -EINVAL;
+	    dst = sim_lookup_res (sim, p[0]);
+	    src = sim_lookup_res (sim, p[5]);
+	    if (!dst || !src)
+		return -EINVAL;
+	    sim_read_box (p + 7, &sbox);
+	    dbox = sbox;
+	    dbox.x = p[2];
+	    dbox.y = p[3];
+	    sim_blit (dst, &dbox, src, &sbox, NULL);
+	    break;
+
+	case SIM_CMD_CLEAR:
+	    /* clears the bound framebuffer, and we never bind one */
+	    break;
+
+	default:
+	    break;
+	}
+
+	i += 1 + len;
+    }
+    return 0;
+}
+
+static void
+sim_parse_latency (virgl_screen_t *virgl, const char *str)
+{
+    struct virgl_sim *sim = virgl->sim;
+    char *copy, *tok, *save = NULL;
+    int i;
+
+    copy = strdup (str);
+    if (!copy)
+	return;
+
+    for (tok = strtok_r (copy, ",", &save); tok;
+	 tok = strtok_r (NULL, ",", &save))
+    {
+	char *eq = strchr (tok, '=');
+
+	if (!eq)
+	{
+	    unsigned int usecs = strtoul (tok, NULL, 0);
+
+	    for (i = 0; i < VIRGL_STAT_NUM_IOCTLS; i++)
+		sim->latency[i] = usecs;
+	    continue;
+	}
+
+	*eq = '\0';
+	for (i = 0; i < VIRGL_STAT_NUM_IOCTLS; i++)
+	{
+	    if (!strcmp (tok, virgl_stats_ioctl_name (i)))
+		break;
+	}
+	if (i == VIRGL_STAT_NUM_IOCTLS)
+	{
+	    xf86DrvMsg (virgl->pScrn->scrnIndex, X_WARNING,
+			"SimulateLatency: unknown ioctl \"%s\"\n", tok);
+	    continue;
+	}
+	sim->latency[i] = strtoul (eq + 1, NULL, 0);
+    }
+
+    free (copy);
+}
+
+Bool
+virgl_sim_init (virgl_screen_t *virgl, const char *latency)
+{
+    struct virgl_sim *sim;
+
+    sim = calloc (1, sizeof (*sim));
+    if (!sim)
+	return FALSE;
+
+    sim->fd = virgl->drm_fd;
+    xorg_list_init (&sim->resources);
+    virgl->sim = sim;
+
+    if (latency)
+	sim_parse_latency (virgl, latency);
+
+    xf86DrvMsg (virgl->pScrn->scrnIndex, X_INFO,
+		"Using simulated virtio-gpu device\n");
+    return TRUE;
+}
+
+/* destroys the resources still left when the screen closes */
+void
+virgl_sim_fini (virgl_screen_t *virgl)
+{
+    struct virgl_sim *sim = virgl->sim;
+    struct sim_resource *res, *tmp;
+    struct drm_gem_close close_bo;
+
+    if (!sim)
+	return;
+
+    xorg_list_for_each_entry_safe (res, tmp, &sim->resources, link)
+    {
+	memset (&close_bo, 0, sizeof (close_bo));
+	close_bo.handle = res->handle;
+	sim_resource_destroy (res);
+	drmIoctl (sim->fd, DRM_IOCTL_GEM_CLOSE, &close_bo);
+    }
+}
+
+int
+virgl_sim_ioctl (virgl_screen_t *virgl, enum virgl_stat_ioctl which,
+		 unsigned long request, void *arg)
+{
+    struct virgl_sim *sim = virgl->sim;
+    struct sim_resource *res;
+    int ret = 0;
+
+    switch (request)
+    {
+    case DRM_IOCTL_VIRTGPU_GETPARAM:
+    {
+	struct drm_virtgpu_getparam *param = arg;
+
+	if (param->param != VIRTGPU_PARAM_3D_FEATURES)
+	{
+	    ret = -EINVAL;
+	    break;
+	}
+	*(uint32_t *)(uintptr_t)param->value = 1;
+	break;
+    }
+    case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE:
+	ret = sim_resource_create (sim, arg);
+	break;
+
+    case DRM_IOCTL_VIRTGPU_MAP:
+    {
+	struct drm_virtgpu_map *map = arg;
+
+	res = sim_lookup_handle (sim, map->handle);
+	if (!res || !sim_guest_map (sim, res))
+	{
+	    ret = -EINVAL;
+	    break;
+	}
+	map->offset = res->map_offset;
+	break;
+    }
+    case DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST:
+    {
+	struct drm_virtgpu_3d_transfer_to_host *xfer = arg;
+
+	ret = sim_transfer (sim, xfer->bo_handle, &xfer->box, xfer->offset,
+			    SIM_XFER_STRIDE (xfer), TRUE);
+	break;
+    }
+    case DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST:
+    {
+	struct drm_virtgpu_3d_transfer_from_host *xfer = arg;
+
+	ret = sim_transfer (sim, xfer->bo_handle, &xfer->box, xfer->offset,
+			    SIM_XFER_STRIDE (xfer), FALSE);
+	break;
+    }
+    case DRM_IOCTL_VIRTGPU_EXECBUFFER:
+	ret = sim_execbuffer (virgl, arg);
+	break;
+
+    case DRM_IOCTL_VIRTGPU_WAIT:
+	/* everything completes synchronously */
+	break;
+
+    case DRM_IOCTL_GEM_CLOSE:
+	res = sim_lookup_handle (sim, ((struct drm_gem_close *)arg)->handle);
+	if (res)
+	    sim_resource_destroy (res);
+	if (drmIoctl (sim->fd, request, arg))
+	    ret = -errno;
+	break;
+
+    default:
+	if (drmIoctl (sim->fd, request, arg))
+	    ret = -errno;
+	break;
+    }
+
+    if (sim->latency[which])
+	usleep (sim->latency[which]);
+
+    if (ret < 0)
+    {
+	errno = -ret;
+	return -1;
+    }
+    return ret;
+}
@@ -0,0 +1,279 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Acceleration and transfer statistics.
+ *
+ * UXA counts accelerated and fallback calls per operation, the driver
+ * counts and times every ioctl and the bytes moved by uploads and
+ * readbacks.  Sending SIGUSR2 to the server dumps everything to the log
+ * and to the VIRGL_STATS property on the root window; the same happens
+ * when the screen is closed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+#include <time.h>
+#include <X11/Xatom.h>
+
+#include "virgl.h"
+#include "property.h"
+
+#define STATS_BUF_SIZE 16384
+
+static volatile sig_atomic_t stats_requested;
+
+static const char *ioctl_names[VIRGL_STAT_NUM_IOCTLS] = {
+    [VIRGL_STAT_RESOURCE_CREATE] = "resource_create",
+    [VIRGL_STAT_MAP] = "map",
+    [VIRGL_STAT_TRANSFER_TO_HOST] = "transfer_to_host",
+    [VIRGL_STAT_TRANSFER_FROM_HOST] = "transfer_from_host",
+    [VIRGL_STAT_EXECBUFFER] = "execbuffer",
+    [VIRGL_STAT_WAIT] = "wait",
+    [VIRGL_STAT_GEM_CLOSE] = "gem_close",
+    [VIRGL_STAT_DIRTYFB] = "dirtyfb",
+    [VIRGL_STAT_OTHER] = "other",
+};
+
+const char *
+virgl_stats_ioctl_name (enum virgl_stat_ioctl which)
+{
+    return ioctl_names[which];
+}
+
+uint64_t
+virgl_stats_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+stats_bucket (uint64_t value)
+{
+    int bucket = 0;
+
+    while (value && bucket < VIRGL_STAT_HIST_BUCKETS - 1)
+    {
+	value >>= 1;
+	bucket++;
+    }
+    return bucket;
+}
+
+void
+virgl_stats_record (struct virgl_ioctl_stats *st, uint64_t start)
+{
+    uint64_t usecs = virgl_stats_now () - start;
+
+    st->count++;
+    st->usecs += usecs;
+    if (usecs > st->max_usecs)
+	st->max_usecs = usecs;
+    st->hist[stats_bucket (usecs)]++;
+}
+
+void
+virgl_stats_ioctl (virgl_screen_t *virgl, enum virgl_stat_ioctl which,
+		   uint64_t start)
+{
+    virgl_stats_record (&virgl->stats.ioctl[which], start);
+}
+
+/* adds counters kept by another thread to the screen's, and clears them */
+void
+virgl_stats_merge (virgl_screen_t *virgl, struct virgl_ioctl_stats *from)
+{
+    int i, j;
+
+    for (i = 0; i < VIRGL_STAT_NUM_IOCTLS; i++)
+    {
+	struct virgl_ioctl_stats *st = &virgl->stats.ioctl[i];
+
+	st->count += from[i].count;
+	st->usecs += from[i].usecs;
+	if (from[i].max_usecs > st->max_usecs)
+	    st->max_usecs = from[i].max_usecs;
+	for (j = 0; j < VIRGL_STAT_HIST_BUCKETS; j++)
+	    st->hist[j] += from[i].hist[j];
+    }
+    memset (from, 0, VIRGL_STAT_NUM_IOCTLS * sizeof (*from));
+}
+
+void
+virgl_stats_transfer (virgl_screen_t *virgl, Bool readback, uint32_t bytes)
+{
+    struct virgl_transfer_stats *st;
+
+    st = readback ? &virgl->stats.readback : &virgl->stats.upload;
+    st->count++;
+    st->bytes += bytes;
+    st->hist[stats_bucket (bytes >> 10)]++;
+}
+
+static void
+stats_signal (int signo)
+{
+    stats_requested = 1;
+}
+
+void
+virgl_stats_init (ScreenPtr pScreen)
+{
+    virgl_screen_t *virgl = xf86ScreenToScrn (pScreen)->driverPrivate;
+    static const char name[] = "VIRGL_STATS";
+
+    virgl->stats.property = MakeAtom (name, sizeof (name) - 1, TRUE);
+    OsSignal (SIGUSR2, stats_signal);
+}
+
+/* called from the block handler, where it is safe to log and touch windows */
+void
+virgl_stats_check (ScreenPtr pScreen)
+{
+    if (!stats_requested)
+	return;
+
+    stats_requested = 0;
+    virgl_stats_dump (pScreen);
+}
+
+static int
+stats_print_hist (char *buf, int size, const uint32_t *hist)
+{
+    int len = 0;
+    int i;
+
+    for (i = 0; i < VIRGL_STAT_HIST_BUCKETS && len < size; i++)
+    {
+	if (!hist[i])
+	    continue;
+	if (i == VIRGL_STAT_HIST_BUCKETS - 1)
+	    len += snprintf (buf + len, size - len, " >=%u:%u",
+			     1u << (i - 1), hist[i]);
+	else
+	    len += snprintf (buf + len, size - len, " <%u:%u",
+			     1u << i, hist[i]);
+    }
+    return len;
+}
+
+static int
+stats_format (virgl_screen_t *virgl, ScreenPtr pScreen, char *buf, int size)
+{
+    uxa_stats_t *uxa_stats = uxa_get_stats (pScreen);
+    struct virgl_transfer_stats *xfer;
+    int len = 0;
+    int i;
+
+#define APPEND(...)							\
+    do {								\
+	if (len < size)							\
+	    len += snprintf (buf + len, size - len, __VA_ARGS__);	\
+    } while (0)
+
+    APPEND ("operation accel fallback\n");
+    for (i = 0; i < UXA_NUM_OPS; i++)
+    {
+	if (!uxa_stats->accel[i] && !uxa_stats->fallback[i])
+	    continue;
+	APPEND ("%s %lu %lu\n", uxa_op_name (i),
+		uxa_stats->accel[i], uxa_stats->fallback[i]);
+    }
+
+    APPEND ("ioctl count usecs max histogram(us)\n");
+    for (i = 0; i < VIRGL_STAT_NUM_IOCTLS; i++)
+    {
+	struct virgl_ioctl_stats *st = &virgl->stats.ioctl[i];
+
+	if (!st->count)
+	    continue;
+	APPEND ("%s %llu %llu %llu", virgl_stats_ioctl_name (i),
+		(unsigned long long)st->count,
+		(unsigned long long)st->usecs,
+		(unsigned long long)st->max_usecs);
+	if (len < size)
+	    len += stats_print_hist (buf + len, size - len, st->hist);
+	APPEND ("\n");
+    }
+
+    APPEND ("transfer count bytes histogram(KiB)\n");
+    for (i = 0; i < 2; i++)
+    {
+	xfer = i ? &virgl->stats.readback : &virgl->stats.upload;
+	APPEND ("%s %llu %llu", i ? "readback" : "upload",
+		(unsigned long long)xfer->count,
+		(unsigned long long)xfer->bytes);
+	if (len < size)
+	    len += stats_print_hist (buf + len, size - len, xfer->hist);
+	APPEND ("\n");
+    }
+
+    APPEND ("memory bytes budget evictions\n");
+    APPEND ("resources %llu %llu %llu\n",
+	    (unsigned long long)virgl->bo_bytes,
+	    (unsigned long long)virgl->bo_budget,
+	    (unsigned long long)virgl->stats.evictions);
+
+#undef APPEND
+
+    return len < size ? len : size - 1;
+}
+
+void
+virgl_stats_dump (ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn (pScreen);
+    virgl_screen_t *virgl = pScrn->driverPrivate;
+    char *buf, *line, *next;
+    int len;
+
+    buf = malloc (STATS_BUF_SIZE);
+    if (!buf)
+	return;
+
+    /* brings in what the submission thread has counted */
+    if (virgl->submit)
+	virgl_submit_sync (virgl);
+
+    len = stats_format (virgl, pScreen, buf, STATS_BUF_SIZE);
+
+    if (pScreen->root)
+	dixChangeWindowProperty (serverClient, pScreen->root,
+				 virgl->stats.property, XA_STRING, 8,
+				 PropModeReplace, len, buf, TRUE);
+
+    for (line = buf; *line; line = next)
+    {
+	next = strchr (line, '\n');
+	if (next)
+	    *next++ = '\0';
+	else
+	    next = line + strlen (line);
+	xf86DrvMsg (pScrn->scrnIndex, X_INFO, "stats: %s\n", line);
+    }
+
+    free (buf);
+}
@@ -0,0 +1,372 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Submission thread.
+ *
+ * With Option "SubmitThread" the ioctls that only push work to the host
+ * (execbuffer, transfer_to_host and DirtyFB) are queued to a worker
+ * thread instead of being issued on the server's main thread.  Every
+ * other ioctl is a synchronization point: it waits for the queue to
+ * drain first, so readbacks, waits, mapping and closing of resources
+ * see the work in the order it was generated.
+ *
+ * Errors from queued ioctls can't be returned to the caller; they are
+ * counted and logged at the next synchronization point.  Statistics for
+ * them are kept apart by the worker and added to the screen's there too,
+ * so only the main thread ever touches those.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "virgl.h"
+
+#ifdef HAVE_PTHREAD_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define SUBMIT_RING_SIZE 32
+
+enum submit_kind {
+    SUBMIT_IOCTL,
+    SUBMIT_DIRTYFB,
+};
+
+struct submit_item {
+    enum submit_kind kind;
+    unsigned long request;
+    union {
+	struct drm_virtgpu_execbuffer eb;
+	struct drm_virtgpu_3d_transfer_to_host xfer;
+	struct {
+	    uint32_t fb_id;
+	    int num_clips;
+	} dirty;
+    } arg;
+
+    /* command stream or clip rectangles, owned by the item */
+    void *data;
+    size_t data_size;
+};
+
+struct virgl_submit {
+    virgl_screen_t *virgl;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+
+    /* items [head, tail) are queued; head only advances once an item
+     * has completed, so head == tail means the worker is idle */
+    struct submit_item items[SUBMIT_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    Bool quit;
+
+    int errors;
+    int last_errno;
+
+    /* only written by the worker while items are queued */
+    struct virgl_ioctl_stats stats[VIRGL_STAT_NUM_IOCTLS];
+};
+
+static void
+submit_run (struct virgl_submit *submit, struct submit_item *item)
+{
+    virgl_screen_t *virgl = submit->virgl;
+    uint64_t start;
+    int ret;
+
+    switch (item->kind)
+    {
+    case SUBMIT_IOCTL:
+	ret = virgl_issue_ioctl (virgl, item->request, &item->arg,
+				 submit->stats);
+	break;
+    case SUBMIT_DIRTYFB:
+	start = virgl_stats_now ();
+	ret = drmModeDirtyFB (virgl->drm_fd, item->arg.dirty.fb_id,
+			      item->data, item->arg.dirty.num_clips);
+	virgl_stats_record (&submit->stats[VIRGL_STAT_DIRTYFB], start);
+	break;
+    default:
+	ret = 0;
+	break;
+    }
+
+    if (ret)
+    {
+	pthread_mutex_lock (&submit->lock);
+	submit->errors++;
+	submit->last_errno = errno;
+	pthread_mutex_unlock (&submit->lock);
+    }
+}
+
+static void *
+submit_thread (void *closure)
+{
+    struct virgl_submit *submit = closure;
+    struct submit_item *item;
+
+    pthread_mutex_lock (&submit->lock);
+    for (;;)
+    {
+	while (submit->head == submit->tail && !submit->quit)
+	    pthread_cond_wait (&submit->work, &submit->lock);
+
+	if (submit->head == submit->tail)
+	    break;
+
+	item = &submit->items[submit->head % SUBMIT_RING_SIZE];
+	pthread_mutex_unlock (&submit->lock);
+
+	submit_run (submit, item);
+
+	pthread_mutex_lock (&submit->lock);
+	submit->head++;
+	pthread_cond_broadcast (&submit->done);
+    }
+    pthread_mutex_unlock (&submit->lock);
+
+    return NULL;
+}
+
+/* returns the next free item, its data buffer at least size bytes */
+static struct submit_item *
+submit_reserve (struct virgl_submit *submit, size_t size)
+{
+    struct submit_item *item;
+
+    pthread_mutex_lock (&submit->lock);
+    while (submit->tail - submit->head == SUBMIT_RING_SIZE)
+	pthread_cond_wait (&submit->done, &submit->lock);
+    pthread_mutex_unlock (&submit->lock);
+
+    /* only this thread queues, so the slot stays free */
+    item = &submit->items[submit->tail % SUBMIT_RING_SIZE];
+
+    if (item->data_size < size)
+    {
+	void *data = realloc (item->data, size);
+
+	if (!data)
+	    return NULL;
+	item->data = data;
+	item->data_size = size;
+    }
+
+    return item;
+}
+
+static void
+submit_commit (struct virgl_submit *submit)
+{
+    pthread_mutex_lock (&submit->lock);
+    submit->tail++;
+    pthread_cond_signal (&submit->work);
+    pthread_mutex_unlock (&submit->lock);
+}
+
+/* FALSE if the request can't be queued and has to be issued directly */
+Bool
+virgl_submit_ioctl (virgl_screen_t *virgl, unsigned long request, void *arg)
+{
+    struct virgl_submit *submit = virgl->submit;
+    struct submit_item *item;
+
+    switch (request)
+    {
+    case DRM_IOCTL_VIRTGPU_EXECBUFFER:
+    {
+	struct drm_virtgpu_execbuffer *eb = arg;
+
+	item = submit_reserve (submit, eb->size);
+	if (!item)
+	    return FALSE;
+
+	/* the encoder reuses its buffer as soon as we return */
+	memcpy (item->data, (void *)(uintptr_t)eb->command, eb->size);
+	item->arg.eb = *eb;
+	item->arg.eb.command = (uintptr_t)item->data;
+	break;
+    }
+    case DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST:
+	item = submit_reserve (submit, 0);
+	if (!item)
+	    return FALSE;
+	item->arg.xfer = *(struct drm_virtgpu_3d_transfer_to_host *)arg;
+	break;
+    default:
+	return FALSE;
+    }
+
+    item->kind = SUBMIT_IOCTL;
+    item->request = request;
+    submit_commit (submit);
+    return TRUE;
+}
+
+Bool
+virgl_submit_dirty_fb (virgl_screen_t *virgl, uint32_t fb_id,
+		       drmModeClip *clips, int num_clips)
+{
+    struct virgl_submit *submit = virgl->submit;
+    struct submit_item *item;
+
+    item = submit_reserve (submit, num_clips * sizeof (drmModeClip));
+    if (!item)
+	return FALSE;
+
+    memcpy (item->data, clips, num_clips * sizeof (drmModeClip));
+    item->kind = SUBMIT_DIRTYFB;
+    item->arg.dirty.fb_id = fb_id;
+    item->arg.dirty.num_clips = num_clips;
+    submit_commit (submit);
+    return TRUE;
+}
+
+/* wait until everything queued so far has been issued */
+void
+virgl_submit_sync (virgl_screen_t *virgl)
+{
+    struct virgl_submit *submit = virgl->submit;
+    int errors, last_errno;
+
+    pthread_mutex_lock (&submit->lock);
+    while (submit->head != submit->tail)
+	pthread_cond_wait (&submit->done, &submit->lock);
+    /* the worker is idle until the next item is queued */
+    virgl_stats_merge (virgl, submit->stats);
+    errors = submit->errors;
+    last_errno = submit->last_errno;
+    submit->errors = 0;
+    pthread_mutex_unlock (&submit->lock);
+
+    if (errors)
+	xf86DrvMsg (virgl->pScrn->scrnIndex, X_ERROR,
+		    "%d queued ioctls failed, last error: %s\n",
+		    errors, strerror (last_errno));
+}
+
+Bool
+virgl_submit_init (virgl_screen_t *virgl)
+{
+    struct virgl_submit *submit;
+    sigset_t all, saved;
+    int ret;
+
+    submit = calloc (1, sizeof (*submit));
+    if (!submit)
+	return FALSE;
+
+    submit->virgl = virgl;
+    pthread_mutex_init (&submit->lock, NULL);
+    pthread_cond_init (&submit->work, NULL);
+    pthread_cond_init (&submit->done, NULL);
+
+    /* signals are for the main thread */
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, &saved);
+    ret = pthread_create (&submit->thread, NULL, submit_thread, submit);
+    pthread_sigmask (SIG_SETMASK, &saved, NULL);
+
+    if (ret)
+    {
+	xf86DrvMsg (virgl->pScrn->scrnIndex, X_WARNING,
+		    "failed to start submission thread: %s\n", strerror (ret));
+	pthread_cond_destroy (&submit->done);
+	pthread_cond_destroy (&submit->work);
+	pthread_mutex_destroy (&submit->lock);
+	free (submit);
+	return FALSE;
+    }
+
+    virgl->submit = submit;
+    xf86DrvMsg (virgl->pScrn->scrnIndex, X_INFO,
+		"Submitting commands from a separate thread\n");
+    return TRUE;
+}
+
+void
+virgl_submit_fini (virgl_screen_t *virgl)
+{
+    struct virgl_submit *submit = virgl->submit;
+    int i;
+
+    if (!submit)
+	return;
+
+    virgl_submit_sync (virgl);
+
+    pthread_mutex_lock (&submit->lock);
+    submit->quit = TRUE;
+    pthread_cond_signal (&submit->work);
+    pthread_mutex_unlock (&submit->lock);
+    pthread_join (submit->thread, NULL);
+
+    for (i = 0; i < SUBMIT_RING_SIZE; i++)
+	free (submit->items[i].data);
+
+    pthread_cond_destroy (&submit->done);
+    pthread_cond_destroy (&submit->work);
+    pthread_mutex_destroy (&submit->lock);
+    free (submit);
+    virgl->submit = NULL;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+Bool
+virgl_submit_ioctl (virgl_screen_t *virgl, unsigned long request, void *arg)
+{
+    return FALSE;
+}
+
+Bool
+virgl_submit_dirty_fb (virgl_screen_t *virgl, uint32_t fb_id,
+		       drmModeClip *clips, int num_clips)
+{
+    return FALSE;
+}
+
+void
+virgl_submit_sync (virgl_screen_t *virgl)
+{
+}
+
+Bool
+virgl_submit_init (virgl_screen_t *virgl)
+{
+    xf86DrvMsg (virgl->pScrn->scrnIndex, X_WARNING,
+		"SubmitThread is not supported by this build\n");
+    return FALSE;
+}
+
+void
+virgl_submit_fini (virgl_screen_t *virgl)
+{
+}
+
+#endif
@@ -89,6 +89,11 @@ virgl_create_primary (virgl_screen_t *virgl, int bpp)
     surface->host_image = host_image;
     surface->virgl = virgl;
     surface->bo = bo;
+    xorg_list_init (&surface->lru);
+    surface->dri2_refs = 0;
+    surface->migrate_image = NULL;
+    xorg_list_init (&surface->migrate_link);
+    REGION_INIT (NULL, &surface->migrate_pending, (BoxPtr)NULL, 0);
     REGION_INIT (NULL, &(surface->access_region), (BoxPtr)NULL, 0);
     surface->access_type = UXA_ACCESS_RO;
     
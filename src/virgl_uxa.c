@@ -58,32 +58,35 @@ virgl_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_t access)
 	goto out;
     }
 
-    REGION_INIT (NULL, &new, (BoxPtr)NULL, 0);
-    REGION_SUBTRACT (NULL, &new, region, &surface->access_region);
+    virgl_surface_touch (surface);
+
+    /* contents still in system memory go to the host first */
+    virgl_kms_migrate_region (surface, region);
+
+    /* the readback must see every queued host operation */
+    if (surface->virgl->gr_enc->buf_offset)
+	virgl_flush (surface->virgl);
 
     if (access == UXA_ACCESS_RW)
 	surface->access_type = UXA_ACCESS_RW;
-    
-    region = &new;
-    
+
+    /* nothing read back yet, so the whole request is new */
+    if (REGION_NOTEMPTY (pScreen, &surface->access_region))
+    {
+	REGION_INIT (NULL, &new, (BoxPtr)NULL, 0);
+	REGION_SUBTRACT (NULL, &new, region, &surface->access_region);
+	region = &new;
+    }
+    else
+	REGION_NULL (NULL, &new);
+
     n_boxes = REGION_NUM_RECTS (region);
     boxes = REGION_RECTS (region);
 
     if (n_boxes < 25)
-    {
-	while (n_boxes--)
-	{
-	    virgl_kms_transfer_get_block (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
-	    
-	    boxes++;
-	}
-    }
+	virgl_kms_transfer_get_boxes (surface, boxes, n_boxes);
     else
-    {
-	virgl_kms_transfer_get_block(
-	    surface,
-	    new.extents.x1, new.extents.y1, new.extents.x2, new.extents.y2);
-    }
+	virgl_kms_transfer_get_boxes (surface, &region->extents, 1);
     
     REGION_UNION (pScreen,
 		  &(surface->access_region),
@@ -170,7 +173,58 @@ good_alu_and_pm (DrawablePtr drawable, int alu, Pixel planemask)
 
 /*
  * Solid fill
+ *
+ * Outside the 3D pipeline the host has no fill command, so a fill is a
+ * blit stretched from a single texel holding the colour.  Spans, points
+ * and thin lines all end up here as rectangles, so a whole request goes
+ * to the host as one batch of blits.
+ *
+ * The colours of one depth are texels of a single row resource rather
+ * than a resource each, which saves a host allocation, a mapping and a
+ * round of ioctls per colour.
  */
+static Bool
+virgl_get_solid (virgl_screen_t *virgl, int bpp, Pixel pixel,
+		 struct virgl_bo **bo, int *x)
+{
+    int depth = bpp == 8 ? 0 : bpp == 16 ? 1 : 2;
+    Bool reused = FALSE;
+    int i;
+
+    if (!virgl->solid_slab[depth].bo)
+    {
+	virgl->solid_slab[depth].bo = virgl_bo_create_solid_slab (virgl, bpp);
+	if (!virgl->solid_slab[depth].bo)
+	    return FALSE;
+	virgl->solid_slab[depth].count = 0;
+    }
+
+    for (i = 0; i < virgl->solid_slab[depth].count; i++)
+    {
+	if (virgl->solid_slab[depth].pixel[i] == pixel)
+	    goto out;
+    }
+
+    if (virgl->solid_slab[depth].count == VIRGL_SOLID_SLAB_SIZE)
+    {
+	i = rand () % VIRGL_SOLID_SLAB_SIZE;
+	reused = TRUE;
+    }
+    else
+    {
+	i = virgl->solid_slab[depth].count++;
+    }
+
+    virgl->solid_slab[depth].pixel[i] = pixel;
+    virgl_bo_write_solid (virgl, virgl->solid_slab[depth].bo, bpp, i, pixel,
+			  reused);
+
+out:
+    *bo = virgl->solid_slab[depth].bo;
+    *x = i;
+    return TRUE;
+}
+
 static Bool
 virgl_check_solid (DrawablePtr drawable, int alu, Pixel planemask)
 {
@@ -188,18 +242,49 @@ virgl_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixel fg)
     if (!(surface = get_surface (pixmap)))
 	return FALSE;
 
-    return FALSE;
+    if (!surface->bo)
+	return FALSE;
+
+    virgl_surface_touch (surface);
+
+    return virgl_get_solid (surface->virgl, pixmap->drawable.bitsPerPixel, fg,
+			    &surface->u.solid.bo, &surface->u.solid.x);
 }
 
 static void
 virgl_solid (PixmapPtr pixmap, int x1, int y1, int x2, int y2)
 {
+    virgl_surface_t *surface = get_surface (pixmap);
+    struct drm_virtgpu_3d_box sbox, dbox;
+    BoxRec box = { x1, y1, x2, y2 };
+
+    virgl_kms_migrate_discard (surface, &box);
+
+    sbox.x = surface->u.solid.x;
+    sbox.y = 0;
+    sbox.z = 0;
+    sbox.w = 1;
+    sbox.h = 1;
+    sbox.d = 1;
 
+    dbox.x = x1;
+    dbox.y = y1;
+    dbox.z = 0;
+    dbox.w = x2 - x1;
+    dbox.h = y2 - y1;
+    dbox.d = 1;
+
+    graw_encode_blit (surface->virgl->gr_enc,
+		      virgl_kms_bo_get_res_handle (surface->bo),
+		      virgl_kms_bo_get_res_handle (surface->u.solid.bo),
+		      &dbox, &sbox,
+		      GRAW_BLIT_FILTER_NEAREST, NULL);
 }
 
 static void
 virgl_done_solid (PixmapPtr pixmap)
 {
+    virgl_flush (get_surface (pixmap)->virgl);
 }
 
 /*
@@ -229,7 +314,9 @@ virgl_prepare_copy (PixmapPtr source, PixmapPtr dest,
     virgl_surface_t *ds = get_surface(dest);
     virgl_surface_t *ss = get_surface(source);
 
-    if (ds->bo && ss->bo && ds != ss) {
+    if (ds->bo && ss->bo) {
+	virgl_surface_touch (ds);
+	virgl_surface_touch (ss);
 	ds->u.copy_src = ss;
 	return TRUE;
     }
@@ -238,13 +325,12 @@ virgl_prepare_copy (PixmapPtr source, PixmapPtr dest,
 }
 
 static void
-virgl_copy (PixmapPtr dest,
-          int src_x1, int src_y1,
-          int dest_x1, int dest_y1,
-          int width, int height)
+virgl_blit_box (virgl_screen_t *virgl,
+		struct virgl_bo *dst_bo, struct virgl_bo *src_bo,
+		int src_x1, int src_y1,
+		int dest_x1, int dest_y1,
+		int width, int height)
 {
-    virgl_surface_t *ds = get_surface(dest);
-    virgl_screen_t *virgl = ds->virgl;
     struct drm_virtgpu_3d_box sbox, dbox;
 
     sbox.x = src_x1;
@@ -261,10 +347,180 @@ virgl_copy (PixmapPtr dest,
     dbox.h = height;
     dbox.d = 1;
     graw_encode_blit(virgl->gr_enc,
-		     virgl_kms_bo_get_res_handle(ds->bo),
-		     virgl_kms_bo_get_res_handle(ds->u.copy_src->bo),
+		     virgl_kms_bo_get_res_handle(dst_bo),
+		     virgl_kms_bo_get_res_handle(src_bo),
 		     &dbox,
-		     &sbox);
+		     &sbox,
+		     GRAW_BLIT_FILTER_NEAREST, NULL);
+}
+
+/*
+ * Overlapping copies within one resource
+ *
+ * The host blit has undefined results when source and destination
+ * overlap, so the copy is split into bands no taller (or wider) than the
+ * copy distance.  Walking the bands against the copy direction, no band
+ * reads pixels that an earlier band has already written.  Every band
+ * is a blit of its own, so when there would be so many that their
+ * overhead outweighs copying the area a second time, or more than a
+ * handful in any case, the source is staged through a scratch resource
+ * instead.
+ */
+
+/* what one more blit costs, in pixels copied */
+#define VIRGL_COPY_BAND_PIXELS 1024
+/* past this many bands a short scroll of a large area is one staged copy */
+#define VIRGL_COPY_MAX_BANDS 32
+
+static struct virgl_bo *
+virgl_get_copy_scratch (virgl_screen_t *virgl, PixmapPtr pixmap,
+			int width, int height)
+{
+    pixman_format_code_t pformat;
+    uint32_t format;
+
+    virgl_get_formats (pixmap->drawable.bitsPerPixel, &pformat, &format);
+
+    if (virgl->copy_scratch				&&
+	virgl->copy_scratch_format == format		&&
+	virgl->copy_scratch_width >= width		&&
+	virgl->copy_scratch_height >= height)
+    {
+	return virgl->copy_scratch;
+    }
+
+    if (virgl->copy_scratch)
+    {
+	/* queued blits may still reference the old scratch resource */
+	virgl_flush (virgl);
+	virgl->bo_funcs->bo_decref (virgl, virgl->copy_scratch);
+
+	if (virgl->copy_scratch_format == format)
+	{
+	    width = max (width, virgl->copy_scratch_width);
+	    height = max (height, virgl->copy_scratch_height);
+	}
+    }
+
+    virgl->copy_scratch = virgl_bo_create_primary_resource (
+	virgl, width, height, width * (pixmap->drawable.bitsPerPixel / 8),
+	format, 0);
+    virgl->copy_scratch_format = format;
+    virgl->copy_scratch_width = width;
+    virgl->copy_scratch_height = height;
+
+    return virgl->copy_scratch;
+}
+
+static void
+virgl_copy_bands (virgl_screen_t *virgl, struct virgl_bo *bo,
+		  int src_x1, int src_y1,
+		  int dest_x1, int dest_y1,
+		  int width, int height)
+{
+    int dx = dest_x1 - src_x1;
+    int dy = dest_y1 - src_y1;
+    int band, pos, n;
+
+    if (dy != 0)
+    {
+	band = abs (dy);
+
+	for (n = 0; n < height; n += band)
+	{
+	    int h = min (band, height - n);
+
+	    /* moving down: start with the bottom band */
+	    pos = dy > 0 ? height - n - h : n;
+	    virgl_blit_box (virgl, bo, bo,
+			    src_x1, src_y1 + pos,
+			    dest_x1, dest_y1 + pos,
+			    width, h);
+	}
+    }
+    else
+    {
+	band = abs (dx);
+
+	for (n = 0; n < width; n += band)
+	{
+	    int w = min (band, width - n);
+
+	    /* moving right: start with the rightmost band */
+	    pos = dx > 0 ? width - n - w : n;
+	    virgl_blit_box (virgl, bo, bo,
+			    src_x1 + pos, src_y1,
+			    dest_x1 + pos, dest_y1,
+			    w, height);
+	}
+    }
+}
+
+static void
+virgl_copy_overlapping (PixmapPtr dest,
+			int src_x1, int src_y1,
+			int dest_x1, int dest_y1,
+			int width, int height)
+{
+    virgl_surface_t *ds = get_surface(dest);
+    virgl_screen_t *virgl = ds->virgl;
+    int dx = dest_x1 - src_x1;
+    int dy = dest_y1 - src_y1;
+    int nbands;
+    struct virgl_bo *scratch;
+
+    if (dy != 0)
+	nbands = (height + abs (dy) - 1) / abs (dy);
+    else
+	nbands = (width + abs (dx) - 1) / abs (dx);
+
+    if (nbands <= VIRGL_COPY_MAX_BANDS &&
+	(int64_t)nbands * VIRGL_COPY_BAND_PIXELS <= (int64_t)width * height)
+    {
+	virgl_copy_bands (virgl, ds->bo, src_x1, src_y1, dest_x1, dest_y1,
+			  width, height);
+	return;
+    }
+
+    /* without a scratch resource the bands are still correct, only slower */
+    scratch = virgl_get_copy_scratch (virgl, dest, width, height);
+    if (!scratch)
+    {
+	virgl_copy_bands (virgl, ds->bo, src_x1, src_y1, dest_x1, dest_y1,
+			  width, height);
+	return;
+    }
+
+    virgl_blit_box (virgl, scratch, ds->bo,
+		    src_x1, src_y1, 0, 0, width, height);
+    virgl_blit_box (virgl, ds->bo, scratch,
+		    0, 0, dest_x1, dest_y1, width, height);
+}
+
+static void
+virgl_copy (PixmapPtr dest,
+          int src_x1, int src_y1,
+          int dest_x1, int dest_y1,
+          int width, int height)
+{
+    virgl_surface_t *ds = get_surface(dest);
+    BoxRec sbox = { src_x1, src_y1, src_x1 + width, src_y1 + height };
+    BoxRec dbox = { dest_x1, dest_y1, dest_x1 + width, dest_y1 + height };
+
+    virgl_kms_migrate_box (ds->u.copy_src, &sbox);
+    virgl_kms_migrate_discard (ds, &dbox);
+
+    if (ds->u.copy_src == ds				&&
+	abs (dest_x1 - src_x1) < width			&&
+	abs (dest_y1 - src_y1) < height)
+    {
+	virgl_copy_overlapping (dest, src_x1, src_y1, dest_x1, dest_y1,
+				width, height);
+	return;
+    }
+
+    virgl_blit_box (ds->virgl, ds->bo, ds->u.copy_src->bo,
+		    src_x1, src_y1, dest_x1, dest_y1, width, height);
 }
 
 static void
@@ -406,13 +662,123 @@ virgl_done_composite (PixmapPtr pDst)
 {
 }
 
+/*
+ * Scaled composite
+ *
+ * A source transform that only scales and translates maps one box onto
+ * another, which is exactly what the host blit does.  The destination
+ * clip is applied with the blit scissor, one blit per clip box.
+ */
+static Bool
+virgl_composite_scaled (PixmapPtr pDst, PixmapPtr pSrc, int filter,
+			BoxPtr dst_box, BoxPtr src_box,
+			BoxPtr clip, int nclip)
+{
+    virgl_surface_t *ds = get_surface (pDst);
+    virgl_surface_t *ss = get_surface (pSrc);
+    struct drm_virtgpu_3d_box sbox, dbox;
+    unsigned graw_filter;
+
+    if (!ds || !ss || !ds->bo || !ss->bo || ds == ss)
+	return FALSE;
+
+    if (pDst->drawable.bitsPerPixel != pSrc->drawable.bitsPerPixel)
+	return FALSE;
+
+    virgl_surface_touch (ds);
+    virgl_surface_touch (ss);
+
+    /* clipped, so the destination isn't necessarily overwritten */
+    virgl_kms_migrate_box (ss, src_box);
+    virgl_kms_migrate_box (ds, dst_box);
+
+    graw_filter = filter == PictFilterBilinear ?
+	GRAW_BLIT_FILTER_LINEAR : GRAW_BLIT_FILTER_NEAREST;
+
+    sbox.x = src_box->x1;
+    sbox.y = src_box->y1;
+    sbox.z = 0;
+    sbox.w = src_box->x2 - src_box->x1;
+    sbox.h = src_box->y2 - src_box->y1;
+    sbox.d = 1;
+
+    dbox.x = dst_box->x1;
+    dbox.y = dst_box->y1;
+    dbox.z = 0;
+    dbox.w = dst_box->x2 - dst_box->x1;
+    dbox.h = dst_box->y2 - dst_box->y1;
+    dbox.d = 1;
+
+    while (nclip--)
+    {
+	graw_encode_blit (ds->virgl->gr_enc,
+			  virgl_kms_bo_get_res_handle (ds->bo),
+			  virgl_kms_bo_get_res_handle (ss->bo),
+			  &dbox, &sbox, graw_filter, clip);
+	clip++;
+    }
+
+    virgl_flush (ds->virgl);
+    return TRUE;
+}
+
 static Bool
 virgl_put_image (PixmapPtr pDst, int x, int y, int w, int h,
                char *src, int src_pitch)
 {
     virgl_surface_t *surface = get_surface (pDst);
+    BoxRec box;
 
-    return FALSE;
+    if (!surface || !surface->bo)
+	return FALSE;
+
+    box.x1 = x;
+    box.y1 = y;
+    box.x2 = x + w;
+    box.y2 = y + h;
+    virgl_kms_migrate_discard (surface, &box);
+
+    /* not flushed: prepare_access submits queued commands before it
+     * reads anything back, so uploads can batch up with other work */
+    return virgl_kms_upload (surface, x, y, w, h, src, src_pitch);
+}
+
+static Bool
+virgl_get_image (PixmapPtr pSrc, int x, int y, int w, int h,
+		 char *dst, int dst_pitch)
+{
+    virgl_surface_t *surface = get_surface (pSrc);
+    int cpp = pSrc->drawable.bitsPerPixel / 8;
+    struct virgl_readback rb;
+    const char *src;
+    int src_pitch;
+    BoxRec band, box;
+
+    if (!surface || !surface->bo)
+	return FALSE;
+
+    box.x1 = x;
+    box.y1 = y;
+    box.x2 = x + w;
+    box.y2 = y + h;
+    virgl_kms_migrate_box (surface, &box);
+
+    virgl_kms_readback_begin (&rb, surface, x, y, x + w, y + h);
+
+    while (virgl_kms_readback_next (&rb, &band, &src, &src_pitch))
+    {
+	char *d = dst + (band.y1 - y) * dst_pitch + (band.x1 - x) * cpp;
+	int n = band.y2 - band.y1;
+
+	while (n--)
+	{
+	    memcpy (d, src, (band.x2 - band.x1) * cpp);
+	    src += src_pitch;
+	    d += dst_pitch;
+	}
+    }
+
+    return !rb.failed;
 }
 
 static void
@@ -526,9 +892,11 @@ set_uxa_functions(virgl_screen_t *virgl, ScreenPtr screen)
     virgl->uxa->prepare_composite = virgl_prepare_composite;
     virgl->uxa->composite = virgl_composite;
     virgl->uxa->done_composite = virgl_done_composite;
+    virgl->uxa->composite_scaled = virgl_composite_scaled;
 
     /* PutImage */
     virgl->uxa->put_image = virgl_put_image;
+    virgl->uxa->get_image = virgl_get_image;
 
     /* Prepare access */
     virgl->uxa->prepare_access = virgl_prepare_access;